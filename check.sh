@@ -0,0 +1,122 @@
+#!/bin/sh
+# Exercise forkargs under fault injection (see 'Testing' in README).
+#
+# Builds a -DFORKARGS_FAULTS binary in a scratch directory and runs it
+# against local slots and a fake ssh, checking that every input line
+# is run exactly once and that the exit-time invariant checks (exit
+# status 3) never fire. Each run is given CHECK_TIMEOUT seconds (60),
+# so that a deadlock fails the check rather than hanging it.
+
+CC=${CC:-cc}
+tmp=`mktemp -d "${TMPDIR:-/tmp}/forkargs-check.XXXXXX"` || exit 1
+trap 'rm -rf "$tmp"' 0
+trap 'exit 1' 1 2 15
+
+$CC $CFLAGS -DFORKARGS_FAULTS -o "$tmp/forkargs" forkargs.c || exit 1
+
+# Fake ssh: skip options, then by host name fail to connect ('down*'),
+# hang without ever connecting ('hang*'), connect after some latency
+# ('slow*'), or just run the command locally.
+mkdir "$tmp/bin"
+cat > "$tmp/bin/ssh" <<'EOF'
+#!/bin/sh
+while :; do
+  case $1 in
+    -[bcDEeFIiJLlmOopQRSWw]) shift 2 ;;
+    -*) shift ;;
+    *) break ;;
+  esac
+done
+host=$1; shift
+case $host in
+  down*) exit 255 ;;
+  hang*) exec sleep 3600 ;;
+  slow*) sleep 0.2 ;;
+esac
+exec sh -c "$*"
+EOF
+chmod +x "$tmp/bin/ssh"
+PATH=$tmp/bin:$PATH
+export PATH
+
+seq 1 50 > "$tmp/in"
+failed=0
+FORKARGS_FAULT_SEED=${FORKARGS_FAULT_SEED:-1}
+export FORKARGS_FAULT_SEED
+timeout=
+if command -v timeout > /dev/null; then
+  timeout="timeout ${CHECK_TIMEOUT:-60}"
+fi
+
+# run <name> <expected status> <faults> <forkargs args...>
+# Runs forkargs on $tmp/in, leaving its output sorted in $tmp/out.
+run ()
+{
+  name=$1; want=$2; FORKARGS_FAULTS=$3; shift 3
+  export FORKARGS_FAULTS
+  $timeout "$tmp/forkargs" "$@" < "$tmp/in" > "$tmp/raw" 2> "$tmp/err"
+  rc=$?
+  sort -n "$tmp/raw" > "$tmp/out"
+  if [ $rc -eq 124 ] && [ -n "$timeout" ]; then
+    echo "FAIL: $name: timed out"
+    failed=1
+    return 1
+  fi
+  if [ $rc -eq 3 ] || [ $rc -ne "$want" ]; then
+    echo "FAIL: $name: exit status $rc, expected $want"
+    cat "$tmp/err"
+    failed=1
+    return 1
+  fi
+  return 0
+}
+
+# every <name>: check that each input line was output exactly once.
+every ()
+{
+  if ! cmp -s "$tmp/in" "$tmp/out"; then
+    echo "FAIL: $1: output does not match input"
+    failed=1
+  else
+    echo "ok: $1"
+  fi
+}
+
+run "local" 0 "" -j4 echo && every "local"
+
+run "spawn faults" 0 "fork-eagain=0.3,eintr=0.3,slow-input=0.1" \
+    -j4 echo && every "spawn faults"
+
+if run "killed jobs" 1 "kill-child=0.2" -k -j4 echo; then
+  if [ `wc -l < "$tmp/out"` -ge 50 ]; then
+    echo "FAIL: killed jobs: no job was killed"
+    failed=1
+  else
+    echo "ok: killed jobs"
+  fi
+fi
+
+run "remote" 0 "fork-eagain=0.2,eintr=0.2" \
+    -j '1,2*hosta,downhost' echo && every "remote"
+
+run "slow remote" 0 "fork-eagain=0.2,eintr=0.2" \
+    -j '1,2*slowhost' echo && every "slow remote"
+
+# The hanging host's test is killed once the other slots are done.
+run "hanging host" 0 "eintr=0.2" -j '2,hanghost' echo \
+  && every "hanging host"
+
+run "prewarm" 0 "eintr=0.2" --prewarm --host-start-rate 20 \
+    --max-connecting 2 -j '3*slowhost' echo && every "prewarm"
+
+run "batch" 0 "eintr=0.2" --batch 4/2 -j '2*hosta' echo && every "batch"
+
+run "commit file" 0 "fork-eagain=0.2,eintr=0.2" \
+    --commit-file "$tmp/commit" -j3 echo \
+  && every "commit file" \
+  && if [ "`cat "$tmp/commit"`" != "50 `wc -c < "$tmp/in" | tr -d " "`" ]; then
+       echo "FAIL: commit file: watermark is '`cat "$tmp/commit"`'"
+       failed=1
+     fi
+
+exit $failed
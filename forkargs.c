@@ -5,16 +5,40 @@
  * pre- and post-commands for remote.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE             /* setns(), unshare() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#endif
 
 
 /* Spawn off <n> jobs at a time.
@@ -30,15 +54,185 @@
 
 FILE *trace = NULL;
 
+/* Token bucket rate limiter. Tokens accumulate at 'rate' per second,
+   up to 'burst'. A rate of zero means no limit. */
+typedef struct TokenBucket TokenBucket;
+struct TokenBucket
+{
+  double rate;
+  double burst;
+  double tokens;
+  double last;                  /* time of last refill */
+};
+
+/* A way of running commands on a host: a command prefix, in which
+   '{host}' stands for the host name. The command to run is added as
+   further arguments, or if the last word is '{cmd}', as a single
+   shell command line in its place. */
+typedef struct Transport Transport;
+struct Transport
+{
+  const char *name;
+  const char *template;
+  int hints;                    /* TRANSPORT_* */
+};
+
+/* Transport performance hints. */
+#define TRANSPORT_SLOW_START 1  /* each session sets up a connection */
+#define TRANSPORT_MULTIPLEX 2   /* sessions share the first connection */
+
+Transport transports[] = {
+  { "ssh", "ssh {host}", TRANSPORT_SLOW_START },
+  { "ssh-mux", ("ssh -o ControlMaster=auto -o ControlPersist=60"
+                " -o ControlPath=~/.ssh/forkargs-%r@%h:%p {host}"),
+    TRANSPORT_MULTIPLEX },
+  { "local", "sh -c {cmd}", 0 },
+  { NULL, NULL, 0 }
+};
+
+/* Per-host state shared by all slots on that host. Host 0 is always
+   the local machine. */
+typedef struct Host Host;
+struct Host
+{
+  char *hostname;               /* NULL for the local machine */
+  TokenBucket start_bucket;     /* --host-start-rate */
+  int warm;                     /* has this host proven itself ready? */
+  double token_retry;           /* when to next ask the token server */
+  int budget;                   /* token server: slots on this host */
+  int in_use;                   /* token server: tokens handed out */
+  char **cmd;                   /* command to run instead, or NULL */
+  int n_cmd;
+  char **transport;             /* command prefix to reach the host */
+  int n_transport;
+  int join_cmd;                 /* pass the command as one argument? */
+  char **ssh_opts;              /* options for ssh transports */
+  int n_ssh_opts;
+  int transport_hints;          /* TRANSPORT_* */
+  int running;                  /* slots busy on the host */
+  double idle_since;            /* when it last became idle */
+  int idle_hooked;              /* has the idle hook run since? */
+  int auto_size;                /* 'auto*host': size from a probe */
+  int slot_limit;               /* how many of its slots may be used */
+  int checking;                 /* first test or probe still running? */
+  pid_t probe_pid;              /* test or probe running, or 0 */
+  int probe_fd;                 /* the probe's output, or -1 */
+  int probe_exited;             /* has it exited, with probe_status? */
+  int probe_status;
+  struct LineBuf *probe_buf;
+};
+
+/* A per-host setting from a hostfile or option, applied when the
+   host's entry is created. */
+typedef struct HostOption HostOption;
+struct HostOption
+{
+  char *hostname;               /* "localhost" for the local machine */
+  char *key;
+  char *value;
+};
+
+/* A named counting resource (--resource), such as license seats. */
+typedef struct Resource Resource;
+struct Resource
+{
+  char *name;
+  int capacity;
+  int in_use;
+};
+
+/* A demand rule (--demand): jobs whose input line matches 'pattern'
+   (all jobs if NULL) need 'amount' units of 'resource'. */
+typedef struct Demand Demand;
+struct Demand
+{
+  int resource;
+  int amount;
+  char *pattern;
+};
+
+/* A source of jobs under fair share (--share), named by the
+   'submitter' tag of their input lines. */
+typedef struct Submitter Submitter;
+struct Submitter
+{
+  char *name;
+  double weight;
+  int quota;                    /* most jobs running at once, or 0 */
+  int running;
+  long finished;
+  double busy;                  /* slot-seconds used */
+};
+
+/* CPU and I/O priorities for jobs (--nice, --ioprio, --sched), and
+   for jobs in a class named by their 'class' tag (--class). */
+typedef struct SchedClass SchedClass;
+struct SchedClass
+{
+  char *name;                   /* NULL for the settings of every job */
+  int nice;                     /* increment, or INT_MIN if unset */
+  int ioprio;                   /* IOPRIO_CLASS_* << 13 | level, or -1 */
+  enum { SCHED_UNSET, SCHED_AS_OTHER, SCHED_AS_BATCH, SCHED_AS_IDLE } policy;
+};
+
+/* A job: one line of input. */
+typedef struct Job Job;
+struct Job
+{
+  char *line;                   /* the line as read, owning storage */
+  char *arg;                    /* argument passed to the command */
+  char *tags;                   /* 'key=value,...' prefix, or NULL */
+  int *demands;                 /* units of each resource required */
+  long seq;                     /* input line number, from 1 */
+  long offset;                  /* byte offset of the line in the input */
+  size_t length;                /* bytes of input, with newline */
+  int submitter;                /* index into submitters */
+  int sched_class;              /* index into sched_classes */
+  int lane;                     /* lane of its batch that runs it */
+  double started;               /* time it started running */
+  Job *next;                    /* next held job, or next in a batch */
+};
+
+/* Buffer for reading lines from a descriptor. */
+typedef struct LineBuf LineBuf;
+struct LineBuf
+{
+  char buf[BUFSIZ];
+  size_t len;
+};
+
 typedef struct Slot Slot;
 struct Slot
 {
   char *hostname;
+  int host;                     /* index into hosts table */
+  int host_rank;                /* number of earlier slots on the host */
   pid_t cpid;
+  double started;               /* time the current job was spawned */
+  double spawn_at;              /* when spawn_job was called, if profiling */
   char **args;
   int n_args;                   /* number of existing args. */
-  char *arg;                    /* current argument */
+  int cmd_arg;                  /* index in args of the command */
+  int remote_arg;               /* index in args of the remote command */
+  Job *job;                     /* current job */
   int remote_slot;
+  int token_held;               /* holds a token server token */
+  pid_t sandbox_pid;            /* process holding the slot's sandbox
+                                   namespaces, or 0 */
+  char *scratch_root;           /* directory holding the slot's scratch
+                                   directory, or NULL */
+  pid_t zygote_pid;             /* the slot's zygote, or 0 */
+  int zygote_fd;                /* socket to the zygote, or -1 */
+  int zygote_ready;             /* has the zygote said READY? */
+  LineBuf *zygote_buf;
+  int batch_fd;                 /* output of a batch session, or -1 */
+  LineBuf *batch_buf;
+  pid_t warm_pid;               /* session waiting for the next job, or 0 */
+  int warm_fd;                  /* its stdin, or -1 */
+  double warm_started;          /* when that session was started */
+  int warm_wanted;              /* start one when the limits allow? */
+  double connect_at;            /* when the job's connection was started */
+  int scratch_gen;              /* number of scratch dirs discarded */
   int faulted;                  /* is this slot unusable (eg. on an
                                    inaccessible remote machine? */
   const char *working_dir;
@@ -48,15 +242,297 @@ struct Slot
 Slot *slots;
 int n_slots = 1;
 
+/* Hosts table */
+Host *hosts;
+int n_hosts = 0;
+HostOption *host_options = NULL;
+int n_host_options = 0;
+int slots_from_env = 0;         /* slots_string came from FORKARGS_J */
+const char *default_transport = "ssh"; /* --transport */
+double reprobe_interval = 0;    /* --reprobe */
+double reprobe_at = 0;
+long auto_mem = 0;              /* --auto-mem, in kilobytes */
+const char *hostfile = NULL;    /* --hostfile */
+
+/* Resources and demand rules */
+Resource *resources;
+int n_resources = 0;
+Demand *demands;
+int n_demands = 0;
+const char **demand_args;       /* --demand, parsed after all options */
+int n_demand_args = 0;
+int job_tags = 0;               /* --job-tags */
+
+/* Fair share between submitters */
+int fair_share = 0;             /* --fair-share, or any --share */
+int lookahead = 64;             /* --lookahead */
+Submitter *submitters;
+int n_submitters = 0;
+
+/* Job priorities. sched_classes[0], if there are any, holds the
+   settings for every job. */
+SchedClass *sched_classes = NULL;
+int n_sched_classes = 0;
+
+/* Input position */
+long input_seq = 0;             /* lines read */
+long input_offset = 0;          /* bytes read */
+size_t input_line_length = 0;   /* bytes in the last line read */
+
+/* Job records */
+FILE *joblog = NULL;            /* --joblog */
+const char *commit_file = NULL; /* --commit-file */
+long commit_seq = 0;            /* last low-watermark written */
+long commit_block_seq = 0;      /* first failed job, which holds the
+                                   watermark back, or 0 */
+long commit_block_offset = 0;
+
 const char *slots_string = NULL;
 int continue_on_error = 0;
 int verbose = 0;
 int skip_slot_test = 0;
+int n_faulted = 0;              /* number of slots marked faulted */
 FILE *in_arguments = NULL;
 int sync_working_dirs = 0;
 
+/* Start rate limits */
+TokenBucket start_bucket;       /* --max-start-rate */
+TokenBucket host_start_limit;   /* --host-start-rate, template for hosts */
+int max_connecting = 0;         /* --max-connecting, 0 for no limit */
+double connect_time = 1.0;      /* --connect-time */
+
+/* Ramp-up policy: bring slots online progressively rather than
+   filling them all at once. */
+enum { RAMP_NONE, RAMP_LINEAR, RAMP_EXP, RAMP_LATENCY } ramp_mode = RAMP_NONE;
+double ramp_duration = 0;       /* linear: time to reach all slots;
+                                   exp: time to double the slots */
+double ramp_start = 0;
+int ramp_limit = 1;             /* latency: current slot limit */
+double ramp_baseline = -1;      /* latency: fastest job seen */
+#define RAMP_LATENCY_FACTOR 2.0
+
 
 int interrupted = 0;
+int n_active = 0;
+int error_encountered = 0;
+
+/* Job accounting, reported in the trace and checked at exit in
+   fault injection builds. */
+typedef struct Stats Stats;
+struct Stats
+{
+  long read;                    /* jobs made from input lines */
+  long started;
+  long finished;
+  long dropped;                 /* read but never started */
+  long spawn_failures;          /* fork failed, job requeued */
+  int min_spawn_limit;          /* lowest concurrency backed off to */
+};
+Stats stats;
+
+/* Spawn failure backoff. When fork() fails for lack of processes or
+   memory, the job is kept for a retry after an exponentially growing
+   delay, and concurrency is capped at what was running, growing back
+   by one slot per completed job. */
+double spawn_backoff = 0;       /* current delay, 0 when healthy */
+double spawn_retry_at = 0;
+int spawn_limit = 0;            /* concurrency cap, 0 for none */
+/* Batched remote sessions (--batch) report each job's exit code on a
+   line of their output starting with this. */
+#define BATCH_MARKER "@@FORKARGS-STATUS@@"
+int batch_size = 1;
+int batch_lanes = 1;
+int prewarm = 0;                /* --prewarm */
+
+/* Jobs read ahead of time but not yet started, in input order. */
+Job *held_jobs = NULL;
+
+#define SPAWN_BACKOFF_MIN 0.05
+#define SPAWN_BACKOFF_MAX 5.0
+
+/* Fault injection, for testing. Compiled in with -DFORKARGS_FAULTS
+   and configured at run time with FORKARGS_FAULTS, a comma-separated
+   list of '<fault>=<probability>':
+     fork-eagain  spawning a job fails with EAGAIN
+     slow-input   reading an input line stalls for up to 100ms
+     eintr        waiting for an event is cut short
+     kill-child   a newly started job is killed with SIGKILL
+   FORKARGS_FAULT_SEED seeds the random number generator. */
+#if defined(FORKARGS_FAULTS)
+int fault (const char *name)
+{
+  static const char *spec = NULL;
+  static int initialised = 0;
+  const char *c;
+  size_t len = strlen (name);
+  if (!initialised)
+    {
+      const char *seed = getenv ("FORKARGS_FAULT_SEED");
+      spec = getenv ("FORKARGS_FAULTS");
+      srand (seed ? atoi (seed) : (int) getpid ());
+      initialised = 1;
+    }
+  for (c = spec; c && (c = strstr (c, name)); c += len)
+    if ((c == spec || c[-1] == ',') && c[len] == '=')
+      return rand () < atof (c + len + 1) * RAND_MAX;
+  return 0;
+}
+#define FAULT(name) fault (name)
+#else
+#define FAULT(name) 0
+#endif
+
+/* SIGCHLD is turned into a readable byte on this pipe, so the event
+   loop can wait for children and timers together with select(). */
+int sigchld_pipe[2] = { -1, -1 };
+
+/* Other descriptors the event loop should wake for. Anything waiting
+   on a descriptor calls watch_fd() before the loop goes to sleep. */
+fd_set watch_fds;
+int max_watch_fd = -1;
+
+/* GNU make jobserver. As a client (MAKEFLAGS has --jobserver-auth) or
+   server (--jobserver), each job beyond the first needs a token read
+   from the jobserver, returned when the job is done. */
+int jobserver_rfd = -1;
+int jobserver_wfd = -1;
+int use_jobserver = 1;          /* cleared by --no-jobserver */
+int jobserver_server = 0;       /* --jobserver */
+char *jobserver_tokens = NULL;  /* tokens held, to be written back */
+int n_jobserver_tokens = 0;
+
+/* Distributed token server, sharing per-host slot budgets between
+   forkargs controllers. */
+const char *token_server_path = NULL;  /* --token-server */
+const char *token_socket_path = NULL;  /* --token-socket */
+FILE *token_socket = NULL;
+#define TOKEN_RETRY 0.2         /* seconds between requests for a host */
+
+/* Per-slot sandboxes */
+int sandbox = 0;                /* --sandbox */
+int sandbox_net = 0;            /* --sandbox-net */
+char *sandbox_cwd = NULL;
+
+/* Per-slot scratch directories */
+const char *scratch_base = NULL;        /* --scratch */
+const char *scratch_size = NULL;        /* --scratch-size */
+pid_t *cleaners = NULL;                 /* 'rm -rf' processes running */
+int n_cleaners = 0;
+
+/* Efficiency mode */
+int pack = 0;                   /* --pack */
+double target_rate = 0;         /* --target-rate, jobs per second */
+double runtime_avg = 0;         /* moving average of job runtimes */
+int runtime_from_history = 0;   /* runtime_avg is from --history */
+const char *idle_hook = NULL;   /* --idle-hook */
+double idle_after = 60;         /* --idle-after */
+pid_t *hooks = NULL;            /* idle hooks running */
+int n_hooks = 0;
+int *slot_order = NULL;         /* slots in the order to try them */
+
+/* Deadline (--deadline) */
+double deadline = 0;            /* when to be finished, as now (), or 0 */
+int deadline_cap = INT_MAX;     /* jobs to run at once to meet it */
+int deadline_slipping = 0;      /* projected to miss it */
+const char *deadline_hook = NULL;       /* --deadline-hook */
+double deadline_hook_at = 0;    /* earliest time to run the hook again */
+int deadline_fd = -1;           /* the hook's output, while running */
+LineBuf *deadline_buf = NULL;
+#define DEADLINE_HOOK_INTERVAL 60
+long input_size = -1;           /* bytes of input to read, if known */
+char **slot_cmd = NULL;         /* the command, for slots added later */
+int n_slot_cmd = 0;
+
+/* Spawner process (--spawner). fork() costs grow with the parent's
+   memory, so jobs can instead be forked by a small process split off
+   before the dispatcher builds up any state. */
+int use_spawner = 0;
+pid_t spawner_pid = -1;
+int spawner_fd = -1;
+
+typedef struct SpawnRequest SpawnRequest;
+struct SpawnRequest
+{
+  enum { SPAWN_JOB, SPAWN_SLOT } type;
+  int slot;
+  int sched_class;
+  size_t len;                   /* length of the argument that follows */
+};
+
+/* A slot added after the spawner split off, sent after a SPAWN_SLOT
+   request and followed by its strings (see spawner_send_slot()). */
+typedef struct SpawnSlot SpawnSlot;
+struct SpawnSlot
+{
+  int host;
+  int join_cmd;
+  int remote_slot;
+  int n_args;
+  int cmd_arg;
+  int remote_arg;
+  pid_t sandbox_pid;
+};
+
+typedef struct SpawnReply SpawnReply;
+struct SpawnReply
+{
+  enum { SPAWNED, EXITED } type;
+  pid_t pid;                    /* -1 if the fork failed */
+  int status;                   /* exit status, or errno from fork */
+};
+
+/* Exits reported by the spawner while waiting for a spawn reply. */
+SpawnReply *spawner_exits = NULL;
+int n_spawner_exits = 0;
+
+/* Zygotes (--zygote): each local slot runs the command once, and it
+   forks a pre-initialised copy of itself for each job. */
+int use_zygote = 0;
+#define ZYGOTE_REPLY_TIMEOUT 10 /* seconds to wait for 'PID' */
+
+/* Self-profiling (--self-profile): the time the dispatcher spends in
+   each phase of its work, reported at exit. */
+enum
+{
+  PROF_INPUT,                   /* reading and parsing input lines */
+  PROF_SCHEDULE,                /* choosing a slot */
+  PROF_FORK,                    /* starting the child */
+  PROF_CHILD_START,             /* from fork until the child runs */
+  PROF_CHILD_SETUP,             /* from then until it execs */
+  PROF_REAP,                    /* collecting finished children */
+  PROF_RECORDS,                 /* --joblog and --commit-file */
+  PROF_TRACE,                   /* printing the slot table */
+  PROF_WAIT,                    /* waiting for something to do */
+  N_PROF
+};
+#define PROF_BUCKETS 32         /* powers of two microseconds */
+
+typedef struct Profile Profile;
+struct Profile
+{
+  const char *name;
+  long count;
+  double total;
+  long hist[PROF_BUCKETS];
+};
+
+int self_profile = 0;
+double profile_start;
+Profile profile[N_PROF] = {
+  [PROF_INPUT] = { .name = "input" },
+  [PROF_SCHEDULE] = { .name = "schedule" },
+  [PROF_FORK] = { .name = "fork" },
+  [PROF_CHILD_START] = { .name = "child-start" },
+  [PROF_CHILD_SETUP] = { .name = "child-setup" },
+  [PROF_REAP] = { .name = "reap" },
+  [PROF_RECORDS] = { .name = "records" },
+  [PROF_TRACE] = { .name = "trace" },
+  [PROF_WAIT] = { .name = "wait" }
+};
+/* Times, per slot, at which the child started running and exec'd,
+   in memory shared with the children. */
+double *child_stamps = NULL;
+int n_child_stamps = 0;
 
 
 /* Signal handling:
@@ -82,505 +558,4887 @@ void interrupt(int signum)
   fprintf (stderr, "forkargs: interrupted, waiting for processes.\n");
 }
 
-char *escape_str (const char *str)
+void child_exited (int signum)
 {
-  char *escaped;
-  int len;
-  char *o;
-  len = strlen (str);
-  escaped = malloc (len * 2 + 1);
-  o = escaped;
-  while (*str)
+  int saved_errno = errno;
+  char c = 0;
+  ssize_t n;
+  /* If the pipe is full, the loop will wake anyway. */
+  n = write (sigchld_pipe[1], &c, 1);
+  (void) n;
+  errno = saved_errno;
+}
+
+void watch_fd (int fd)
+{
+  if (max_watch_fd < 0)
+    FD_ZERO (&watch_fds);
+  FD_SET (fd, &watch_fds);
+  if (fd > max_watch_fd)
+    max_watch_fd = fd;
+}
+
+/* Monotonic time in seconds. */
+double now (void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  {
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+}
+
+/* Start timing a phase: the time now, if profiling. */
+double prof_begin (void)
+{
+  return self_profile ? now () : 0;
+}
+
+/* Count SECS spent in PHASE. */
+void prof_add (int phase, double secs)
+{
+  Profile *p = &profile[phase];
+  double us = secs * 1e6;
+  int b = 0;
+  while (us >= 2 && b < PROF_BUCKETS - 1)
+    us /= 2, b++;
+  p->count++;
+  p->total += secs;
+  p->hist[b]++;
+}
+
+/* End timing PHASE, begun at T0. */
+void prof_end (int phase, double t0)
+{
+  if (self_profile)
+    prof_add (phase, now () - t0);
+}
+
+/* Record, in a child about to become job in SLOT, that it has got as
+   far as STAMP (0 for running, 1 for exec). */
+void prof_child_stamp (int slot, int stamp)
+{
+  if (child_stamps && slot < n_child_stamps)
+    child_stamps[2 * slot + stamp] = now ();
+}
+
+/* Share memory with children for their timings. */
+void profile_setup (void)
+{
+  profile_start = now ();
+  n_child_stamps = n_slots;
+  child_stamps = mmap (NULL, sizeof (double) * 2 * n_slots,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0);
+  if (child_stamps == MAP_FAILED)
     {
-      if (!(isalnum (*str)
-            || *str == '_'
-            || *str == '-'
-            || *str == '/'
-            || *str == '.'))
-        *o++ = '\\';
-      *o++ = *str++;        
+      perror ("forkargs: mmap");
+      child_stamps = NULL;
     }
-  *o++ = '\0';
-  escaped = realloc (escaped, strlen (escaped) + 1);
-  return escaped;
 }
 
-void print_slots(FILE *out)
+/* Print the time spent in each phase, with a histogram of how long
+   each took: each entry counts those from the time shown to twice
+   it. */
+void profile_report (FILE *out)
 {
-  fprintf (out, "Slots:\n");
-  if (slots)
+  double wall = now () - profile_start, accounted = 0;
+  int i, b;
+  fprintf (out, "forkargs: profile over %.3fs:\n", wall);
+  for (i = 0; i < N_PROF; i++)
     {
-      int i;
-      for (i = 0; i < n_slots; i++)
+      Profile *p = &profile[i];
+      /* Children's time overlaps the dispatcher's, so is not part of
+         the total. */
+      int child = i == PROF_CHILD_START || i == PROF_CHILD_SETUP;
+      if (!p->count)
+        continue;
+      if (!child)
+        accounted += p->total;
+      fprintf (out, "  %-12s %8ld %10.3fs ", p->name, p->count, p->total);
+      if (child)
+        fprintf (out, "%6s", "");
+      else
+        fprintf (out, "%5.1f%%", wall > 0 ? 100 * p->total / wall : 0);
+      fprintf (out, " %10.1fus mean\n  %12s", 1e6 * p->total / p->count, "");
+      for (b = 0; b < PROF_BUCKETS; b++)
+        if (p->hist[b])
+          {
+            double lo = b ? (double) (1L << b) : 0;
+            if (lo < 1e3)
+              fprintf (out, " %.0fus:%ld", lo, p->hist[b]);
+            else if (lo < 1e6)
+              fprintf (out, " %.0fms:%ld", lo / 1e3, p->hist[b]);
+            else
+              fprintf (out, " %.0fs:%ld", lo / 1e6, p->hist[b]);
+          }
+      fprintf (out, "\n");
+    }
+  fprintf (out, "  %-12s %8s %10.3fs %5.1f%%\n", "other", "",
+           wall - accounted, wall > 0 ? 100 * (wall - accounted) / wall : 0);
+}
+
+void bucket_init (TokenBucket *b, double rate, double burst)
+{
+  b->rate = rate;
+  b->burst = burst < 1 ? 1 : burst;
+  b->tokens = b->burst;
+  b->last = now ();
+}
+
+/* Return 0 if a token is available at time T, otherwise the delay
+   until one will be. */
+double bucket_delay (TokenBucket *b, double t)
+{
+  if (b->rate <= 0)
+    return 0;
+  b->tokens += (t - b->last) * b->rate;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->last = t;
+  if (b->tokens >= 1)
+    return 0;
+  return (1 - b->tokens) / b->rate;
+}
+
+void bucket_take (TokenBucket *b)
+{
+  if (b->rate > 0)
+    b->tokens -= 1;
+}
+
+/* Give back a token taken for a job that could not start. */
+void bucket_refund (TokenBucket *b)
+{
+  if (b->rate > 0 && b->tokens + 1 <= b->burst)
+    b->tokens += 1;
+}
+
+/* Parse 'RATE[:BURST]' into a bucket. */
+void parse_rate (const char *str, TokenBucket *b)
+{
+  char *end;
+  double rate, burst = 1;
+  rate = strtod (str, &end);
+  if (*end == ':')
+    burst = strtod (end + 1, &end);
+  if (*end || rate < 0 || burst < 0)
+    {
+      fprintf (stderr, "Bad rate: '%s'\n", str);
+      exit (2);
+    }
+  bucket_init (b, rate, burst);
+}
+
+/* Parse '--ramp-up' policy: 'linear:<secs>', 'exp:<secs>' or
+   'latency'. */
+void parse_ramp (const char *str)
+{
+  const char *colon = strchr (str, ':');
+  size_t len = colon ? (size_t) (colon - str) : strlen (str);
+  if (!strncmp (str, "linear", len) && colon)
+    ramp_mode = RAMP_LINEAR;
+  else if (!strncmp (str, "exp", len) && colon)
+    ramp_mode = RAMP_EXP;
+  else if (!strncmp (str, "latency", len) && !colon)
+    ramp_mode = RAMP_LATENCY;
+  else
+    {
+      fprintf (stderr, "Bad ramp-up policy: '%s'\n", str);
+      exit (2);
+    }
+  if (colon)
+    {
+      ramp_duration = atof (colon + 1);
+      if (ramp_duration <= 0)
         {
-          fprintf (out, "%60s %5d '%s'\n",
-                   slots[i].hostname? slots[i].hostname : "(localhost)",
-                   slots[i].cpid,
-                   (slots[i].faulted? "FAULTED" : 
-                    slots[i].cpid != -1? slots[i].arg :
-                    "-"));
-          fprintf (out, "%60s %5s wd: '%s'\n",
-                   "", "", slots[i].working_dir);
+          fprintf (stderr, "Bad ramp-up duration: '%s'\n", colon + 1);
+          exit (2);
+        }
+    }
+}
+
+/* Parse --deadline: a number of seconds from now (or minutes or
+   hours, with an 'm' or 'h' suffix), or a clock time 'HH:MM[:SS]',
+   which is taken to be tomorrow if it has passed today. */
+void parse_deadline (const char *str)
+{
+  double secs;
+  if (strchr (str, ':'))
+    {
+      time_t t = time (NULL);
+      struct tm tm = *localtime (&t);
+      tm.tm_sec = 0;
+      if (sscanf (str, "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 2)
+        {
+          fprintf (stderr, "Bad deadline: '%s'\n", str);
+          exit (2);
         }
+      tm.tm_isdst = -1;
+      secs = difftime (mktime (&tm), t);
+      if (secs <= 0)
+        secs += 24 * 60 * 60;
     }
   else
     {
-      fprintf (out, "(no slots)\n");
+      char *end;
+      secs = strtod (str, &end);
+      if (*end == 'm')
+        secs *= 60, end++;
+      else if (*end == 'h')
+        secs *= 60 * 60, end++;
+      else if (*end == 's')
+        end++;
+      if (end == str || *end || secs <= 0)
+        {
+          fprintf (stderr, "Bad deadline: '%s'\n", str);
+          exit (2);
+        }
     }
+  deadline = now () + secs;
 }
 
-char *working_dir_str(const char *str, int remote)
+/* Take the average runtime of the successful jobs in a previous joblog
+   as the first estimate of job runtimes. A missing file is no error,
+   so that it can be the joblog this run appends to. */
+void read_history (const char *name)
 {
-  if (str[0] == '~' && !remote)
+  FILE *f = fopen (name, "r");
+  char line[BUFSIZ];
+  double runtime, total = 0;
+  int status;
+  long n = 0;
+  if (!f)
     {
-      const char *home = getenv("HOME");
-      int len = strlen(str) + strlen(home) + (str[1] != '/');
-      char *res = malloc(len + 1);
-      sprintf(res, "%s%s%s", home, (str[1] != '/' && str[1])?"/":"",
-              &str[1]);
-      return res;
+      if (errno == ENOENT)
+        return;
+      perror (name);
+      exit (2);
     }
-  else
-    return strdup(str);
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "%*d %*d %*d %*s %lf %d", &runtime, &status) == 2
+        && status == 0)
+      {
+        total += runtime;
+        n++;
+      }
+  fclose (f);
+  if (n)
+    {
+      runtime_avg = total / n;
+      runtime_from_history = 1;
+    }
+  if (trace)
+    fprintf (trace, "forkargs: %ld jobs in '%s', %.3fs on average\n",
+             n, name, runtime_avg);
 }
 
-/* Initialise slots */
-void setup_slots(const char *str, char ** args, int n_args)
+/* Number of slots the ramp-up policy allows to be busy at time T,
+   out of N usable slots. If that is fewer than N and the limit will
+   rise with time, *WAKE is set to the delay until it does. */
+int ramp_slots (int n, double t, double *wake)
+{
+  double elapsed = t - ramp_start;
+  int limit = n;
+  *wake = -1;
+  switch (ramp_mode)
+    {
+    case RAMP_NONE:
+      break;
+    case RAMP_LINEAR:
+      limit = 1 + (int) ((n - 1) * elapsed / ramp_duration);
+      if (limit < n)
+        *wake = ramp_start + limit * ramp_duration / (n - 1) - t;
+      break;
+    case RAMP_EXP:
+      {
+        int steps = (int) (elapsed / ramp_duration);
+        limit = steps < 30 ? 1 << steps : n;
+        if (limit < n)
+          *wake = ramp_start + (steps + 1) * ramp_duration - t;
+      }
+      break;
+    case RAMP_LATENCY:
+      limit = ramp_limit;
+      break;
+    }
+  if (limit >= n)
+    {
+      /* Fully ramped up: stop applying the policy. */
+      ramp_mode = RAMP_NONE;
+      limit = n;
+    }
+  return limit;
+}
+
+/* Latency-gated ramp-up: open another slot whenever a job completes
+   without its runtime inflating well beyond the fastest seen so far,
+   which would suggest a shared resource is already saturated. */
+void ramp_job_done (double runtime)
+{
+  if (ramp_mode != RAMP_LATENCY)
+    return;
+  if (ramp_baseline < 0 || runtime < ramp_baseline)
+    ramp_baseline = runtime;
+  if (runtime <= ramp_baseline * RAMP_LATENCY_FACTOR)
+    ramp_limit++;
+}
+
+/* Parse '--resource NAME=N'. */
+void parse_resource (const char *str)
 {
+  const char *eq = strchr (str, '=');
+  char *end = NULL;
+  long n = eq ? strtol (eq + 1, &end, 10) : 0;
   int i;
-  n_slots = 1;                  /* default to 1 slot */
-  /* On platforms that can report the number of CPUs this way, use
-     that as a default. */
-#if defined(_SC_NPROCESSORS_ONLN)
-  n_slots = sysconf(_SC_NPROCESSORS_ONLN);
-  if (trace)
-    fprintf (trace, "forkargs: defaulting to %d slots\n", n_slots);
-#endif
-  slots = calloc (sizeof (Slot), n_slots);
-  for (i = 0; i < n_slots; i++)
+  if (!eq || eq == str || end == eq + 1 || *end || n <= 0 || n > INT_MAX)
     {
-      slots[i].hostname = NULL;
-      slots[i].cpid = -1;
-      slots[i].arg = NULL;
-      slots[i].args = args;
-      slots[i].n_args = n_args;
+      fprintf (stderr, "Bad resource: '%s'\n", str);
+      exit (2);
+    }
+  for (i = 0; i < n_resources; i++)
+    if (strlen (resources[i].name) == (size_t) (eq - str)
+        && !strncmp (resources[i].name, str, eq - str))
+      break;
+  if (i == n_resources)
+    {
+      resources = realloc (resources, sizeof (*resources) * (++n_resources));
+      resources[i].name = strndup (str, eq - str);
+      resources[i].in_use = 0;
     }
+  resources[i].capacity = n;
+}
 
-  /* Parse the slots string and set up additional slots. */
-  if (str)
+/* Find resource NAME (of length LEN), or -1. */
+int resource_index (const char *name, size_t len)
+{
+  int i;
+  for (i = 0; i < n_resources; i++)
+    if (strlen (resources[i].name) == len
+        && !strncmp (resources[i].name, name, len))
+      return i;
+  return -1;
+}
+
+/* Parse '--demand NAME=K[:PATTERN]'. Called once all the options
+   have been read, so the resource may be defined after the rule. */
+void parse_demand (const char *str)
+{
+  const char *eq = strchr (str, '=');
+  char *end;
+  long k;
+  Demand d;
+  d.resource = eq ? resource_index (str, eq - str) : -1;
+  if (d.resource < 0)
+    {
+      fprintf (stderr, "Unknown resource in demand: '%s'\n", str);
+      exit (2);
+    }
+  k = strtol (eq + 1, &end, 10);
+  d.amount = k;
+  d.pattern = NULL;
+  if (*end == ':')
+    d.pattern = strdup (end + 1);
+  if (end == eq + 1 || k < 0 || k > INT_MAX || (*end && *end != ':'))
     {
-      const char *c = str;
+      fprintf (stderr, "Bad demand: '%s'\n", str);
+      exit (2);
+    }
+  demands = realloc (demands, sizeof (*demands) * (++n_demands));
+  demands[n_demands - 1] = d;
+}
 
-      n_slots = 0;
-      while (*c)
+/* Find submitter NAME (of length LEN), adding it with weight 1 if
+   it is new. */
+int submitter_index (const char *name, size_t len)
+{
+  int i;
+  for (i = 0; i < n_submitters; i++)
+    if (strlen (submitters[i].name) == len
+        && !strncmp (submitters[i].name, name, len))
+      return i;
+  submitters = realloc (submitters, sizeof (*submitters) * (++n_submitters));
+  memset (&submitters[i], 0, sizeof (*submitters));
+  submitters[i].name = strndup (name, len);
+  submitters[i].weight = 1;
+  return i;
+}
+
+/* Parse '--share NAME=WEIGHT[:QUOTA]'. */
+void parse_share (const char *str)
+{
+  const char *eq = strchr (str, '=');
+  char *end;
+  double weight;
+  int i;
+  if (!eq || eq == str || (weight = strtod (eq + 1, &end)) <= 0
+      || (*end && *end != ':'))
+    {
+      fprintf (stderr, "Bad share: '%s'\n", str);
+      exit (2);
+    }
+  i = submitter_index (str, eq - str);
+  submitters[i].weight = weight;
+  if (*end == ':')
+    {
+      const char *quota = end + 1;
+      long q = strtol (quota, &end, 10);
+      if (end == quota || *end || q < 0 || q > INT_MAX)
         {
-          int num_slots = 1;
-          char hostname[BUFSIZ] = "localhost";
-          char working_dir[BUFSIZ] = "";
+          fprintf (stderr, "Bad share quota: '%s'\n", str);
+          exit (2);
+        }
+      submitters[i].quota = q;
+    }
+  fair_share = 1;
+}
 
-          while (*c && isspace(*c))
-            c++;
+/* Find the job priority class NAME, or with NULL, the settings for
+   every job, creating it if need be. */
+SchedClass *sched_class (const char *name, size_t len)
+{
+  int i;
+  if (!n_sched_classes)
+    {
+      sched_classes = calloc (1, sizeof (*sched_classes));
+      sched_classes[0].nice = INT_MIN;
+      sched_classes[0].ioprio = -1;
+      n_sched_classes = 1;
+    }
+  if (!name)
+    return &sched_classes[0];
+  for (i = 1; i < n_sched_classes; i++)
+    if (strlen (sched_classes[i].name) == len
+        && !strncmp (sched_classes[i].name, name, len))
+      return &sched_classes[i];
+  sched_classes = realloc (sched_classes,
+                           sizeof (*sched_classes) * (++n_sched_classes));
+  memset (&sched_classes[i], 0, sizeof (*sched_classes));
+  sched_classes[i].name = strndup (name, len);
+  sched_classes[i].nice = INT_MIN;
+  sched_classes[i].ioprio = -1;
+  return &sched_classes[i];
+}
 
-          /* int '*' hostname ? */
-          if (*c && isdigit(*c))
+/* Parse a priority setting, as for --nice, --ioprio or --sched, into
+   SC. */
+void parse_priority (SchedClass *sc, const char *key, const char *value)
+{
+  char *end;
+  if (!strcmp (key, "nice"))
+    {
+      sc->nice = strtol (value, &end, 10);
+      if (end == value || *end)
+        goto bad;
+    }
+  else if (!strcmp (key, "ioprio"))
+    {
+      /* Classes as in linux/ioprio.h. */
+      if (!strcmp (value, "idle"))
+        sc->ioprio = 3 << 13;
+      else if (!strncmp (value, "best-effort", 11)
+               && (!value[11] || value[11] == ':'))
+        {
+          int level = value[11] ? strtol (value + 12, &end, 10) : 4;
+          if (value[11] && (end == value + 12 || *end || level < 0
+                            || level > 7))
+            goto bad;
+          sc->ioprio = 2 << 13 | level;
+        }
+      else
+        goto bad;
+    }
+  else if (!strcmp (key, "sched"))
+    {
+      if (!strcmp (value, "batch"))
+        sc->policy = SCHED_AS_BATCH;
+      else if (!strcmp (value, "idle"))
+        sc->policy = SCHED_AS_IDLE;
+      else if (!strcmp (value, "other"))
+        sc->policy = SCHED_AS_OTHER;
+      else
+        goto bad;
+    }
+  else
+    goto bad;
+  return;
+ bad:
+  fprintf (stderr, "Bad priority setting: '%s=%s'\n", key, value);
+  exit (2);
+}
+
+/* Parse '--class NAME=KEY=VALUE,...', with KEY 'nice', 'ioprio' or
+   'sched'. */
+void parse_sched_class (const char *str)
+{
+  const char *eq = strchr (str, '=');
+  SchedClass *sc;
+  char *settings, *item, *save;
+  if (!eq || eq == str)
+    {
+      fprintf (stderr, "Bad class: '%s'\n", str);
+      exit (2);
+    }
+  sched_class (NULL, 0);
+  sc = sched_class (str, eq - str);
+  settings = strdup (eq + 1);
+  for (item = strtok_r (settings, ",", &save); item;
+       item = strtok_r (NULL, ",", &save))
+    {
+      char *v = strchr (item, '=');
+      if (!v)
+        {
+          fprintf (stderr, "Bad class setting: '%s'\n", item);
+          exit (2);
+        }
+      *v++ = '\0';
+      parse_priority (sc, item, v);
+    }
+  free (settings);
+}
+
+/* Report how each submitter's jobs used the slots. */
+void fair_report (FILE *out)
+{
+  int i;
+  for (i = 0; i < n_submitters; i++)
+    fprintf (out, "forkargs: submitter %s: %ld jobs, %.1f slot-seconds\n",
+             submitters[i].name, submitters[i].finished, submitters[i].busy);
+}
+
+/* Look up the value of tag KEY on JOB, returning its length in
+   *LEN, or NULL if the job has no such tag. */
+const char *job_tag (Job *job, const char *key, size_t *len)
+{
+  const char *c = job->tags;
+  size_t key_len = strlen (key);
+  while (c && *c)
+    {
+      size_t n = strcspn (c, ",");
+      const char *eq = memchr (c, '=', n);
+      if (eq && (size_t) (eq - c) == key_len && !strncmp (c, key, key_len))
+        {
+          *len = n - key_len - 1;
+          return eq + 1;
+        }
+      c += n;
+      if (*c == ',')
+        c++;
+    }
+  return NULL;
+}
+
+/* Make a job from input LINE, which it takes ownership of. */
+Job *make_job (char *line)
+{
+  Job *job = calloc (1, sizeof (*job));
+  int i;
+  stats.read++;
+  job->seq = input_seq;
+  job->length = input_line_length;
+  job->offset = input_offset - input_line_length;
+  job->line = line;
+  job->arg = line;
+  if (job_tags)
+    {
+      char *tab = strchr (line, '\t');
+      if (tab)
+        {
+          *tab = '\0';
+          job->tags = line;
+          job->arg = tab + 1;
+        }
+    }
+  if (n_resources)
+    {
+      job->demands = calloc (n_resources, sizeof (int));
+      for (i = 0; i < n_demands; i++)
+        if (!demands[i].pattern
+            || !fnmatch (demands[i].pattern, job->arg, 0))
+          job->demands[demands[i].resource] = demands[i].amount;
+      /* Explicit tags override the rules. */
+      for (i = 0; i < n_resources; i++)
+        {
+          size_t len;
+          const char *v = job_tag (job, resources[i].name, &len);
+          char *end;
+          long k;
+          if (!v)
+            continue;
+          k = strtol (v, &end, 10);
+          if (end == v || k < 0 || (size_t) (end - v) != len)
+            fprintf (stderr, "forkargs: ignoring bad demand tag '%s=%.*s'\n",
+                     resources[i].name, (int) len, v);
+          else
+            job->demands[i] = k;
+        }
+    }
+  if (fair_share)
+    {
+      size_t len;
+      const char *v = job_tag (job, "submitter", &len);
+      job->submitter = v ? submitter_index (v, len)
+        : submitter_index ("default", 7);
+    }
+  if (n_sched_classes > 1)
+    {
+      size_t len;
+      const char *v = job_tag (job, "class", &len);
+      for (i = 1; v && i < n_sched_classes; i++)
+        if (strlen (sched_classes[i].name) == len
+            && !strncmp (sched_classes[i].name, v, len))
+          job->sched_class = i;
+    }
+  return job;
+}
+
+void free_job (Job *job)
+{
+  free (job->line);
+  free (job->demands);
+  free (job);
+}
+
+/* Are the resources JOB needs available? Returns 1 if so, 0 if not
+   yet, and -1 if they never will be. */
+int resources_available (Job *job)
+{
+  int i, ok = 1;
+  if (!job->demands)
+    return 1;
+  for (i = 0; i < n_resources; i++)
+    {
+      if (job->demands[i] > resources[i].capacity)
+        return -1;
+      if (resources[i].in_use + job->demands[i] > resources[i].capacity)
+        ok = 0;
+    }
+  return ok;
+}
+
+/* Acquire (DIR 1) or release (DIR -1) the resources of JOB. */
+void claim_resources (Job *job, int dir)
+{
+  int i;
+  if (job->demands)
+    for (i = 0; i < n_resources; i++)
+      resources[i].in_use += dir * job->demands[i];
+}
+
+/* Split STR into words at whitespace, honouring single and double
+   quotes. Returns a NULL-terminated array, with the count in *N. */
+char **split_words (const char *str, int *n)
+{
+  char **words = calloc (strlen (str) / 2 + 2, sizeof (*words));
+  char *word = malloc (strlen (str) + 1);
+  *n = 0;
+  for (;;)
+    {
+      char *o = word;
+      char quote = 0;
+      while (*str && isspace (*str))
+        str++;
+      if (!*str)
+        break;
+      while (*str && (quote || !isspace (*str)))
+        {
+          if (quote && *str == quote)
+            quote = 0;
+          else if (!quote && (*str == '\'' || *str == '"'))
+            quote = *str;
+          else
+            *o++ = *str;
+          str++;
+        }
+      *o = '\0';
+      words[(*n)++] = strdup (word);
+    }
+  free (word);
+  return words;
+}
+
+void add_host_option (const char *hostname, const char *key,
+                      const char *value)
+{
+  HostOption *o;
+  host_options = realloc (host_options,
+                          sizeof (*host_options) * (n_host_options + 1));
+  o = &host_options[n_host_options++];
+  o->hostname = strdup (hostname);
+  o->key = strdup (key);
+  o->value = strdup (value);
+}
+
+/* Parse a memory size such as '512m' into kilobytes. */
+long parse_kilobytes (const char *str)
+{
+  char *end;
+  double size = strtod (str, &end);
+  switch (tolower (*end))
+    {
+    case 'g':
+      size *= 1024 * 1024;
+      end++;
+      break;
+    case 'm':
+      size *= 1024;
+      end++;
+      break;
+    case 'k':
+      end++;
+      break;
+    case '\0':
+      break;
+    default:
+      size = -1;
+    }
+  if (size <= 0 || *end)
+    {
+      fprintf (stderr, "Bad size: '%s'\n", str);
+      exit (2);
+    }
+  return (long) size;
+}
+
+/* Parse '--batch K[/M]'. */
+void parse_batch (const char *str)
+{
+  char *end;
+  batch_size = strtol (str, &end, 10);
+  batch_lanes = 1;
+  if (*end == '/')
+    batch_lanes = strtol (end + 1, &end, 10);
+  if (*end || batch_size < 1 || batch_lanes < 1)
+    {
+      fprintf (stderr, "Bad batch size: '%s'\n", str);
+      exit (2);
+    }
+}
+
+/* Parse '--host-cmd HOST=COMMAND'. */
+void parse_host_cmd (const char *str)
+{
+  const char *eq = strchr (str, '=');
+  char *hostname;
+  if (!eq || eq == str)
+    {
+      fprintf (stderr, "Bad host command: '%s'\n", str);
+      exit (2);
+    }
+  hostname = strndup (str, eq - str);
+  add_host_option (hostname, "cmd", eq + 1);
+  free (hostname);
+}
+
+/* Parse transport hints such as 'slow-start,multiplex'. */
+int parse_hints (const char *str)
+{
+  int hints = 0;
+  while (*str)
+    {
+      size_t len = strcspn (str, ",");
+      if (len == 10 && !strncmp (str, "slow-start", len))
+        hints |= TRANSPORT_SLOW_START;
+      else if (len == 9 && !strncmp (str, "multiplex", len))
+        hints |= TRANSPORT_MULTIPLEX;
+      else if (len)
+        {
+          fprintf (stderr, "Bad transport hint: '%.*s'\n", (int) len, str);
+          exit (2);
+        }
+      str += len;
+      if (*str)
+        str++;
+    }
+  return hints;
+}
+
+/* Set HOST's transport from SPEC: the name of a built-in transport,
+   or a command template. */
+void host_set_transport (Host *host, const char *spec)
+{
+  const char *template = spec;
+  int i, hints = 0;
+  for (i = 0; transports[i].name; i++)
+    if (!strcmp (transports[i].name, spec))
+      {
+        template = transports[i].template;
+        hints = transports[i].hints;
+        break;
+      }
+  host->transport = split_words (template, &host->n_transport);
+  host->transport_hints = hints;
+  host->join_cmd = 0;
+  if (host->n_transport > 0
+      && !strcmp (host->transport[host->n_transport - 1], "{cmd}"))
+    {
+      host->join_cmd = 1;
+      host->transport[--host->n_transport] = NULL;
+    }
+  for (i = 0; i < host->n_transport; i++)
+    {
+      char *word = host->transport[i];
+      char *h = strstr (word, "{host}");
+      const char *name = host->hostname ? host->hostname : "localhost";
+      if (!h)
+        continue;
+      host->transport[i] = malloc (strlen (word) + strlen (name));
+      sprintf (host->transport[i], "%.*s%s%s", (int) (h - word), word, name,
+               h + 6);
+      free (word);
+    }
+  if (host->n_transport == 0)
+    {
+      fprintf (stderr, "forkargs: bad transport '%s'\n", spec);
+      exit (2);
+    }
+}
+
+/* Add ssh option FLAG, with VALUE (or if FLAG is '-o', option
+   KEY=VALUE) to HOST. */
+void host_add_ssh_opt (Host *host, const char *flag, const char *key,
+                       const char *value)
+{
+  char *opt = malloc (strlen (value) + (key ? strlen (key) + 2 : 1));
+  if (key)
+    sprintf (opt, "%s=%s", key, value);
+  else
+    strcpy (opt, value);
+  host->ssh_opts = realloc (host->ssh_opts,
+                            sizeof (char *) * (host->n_ssh_opts + 2));
+  host->ssh_opts[host->n_ssh_opts++] = (char *) flag;
+  host->ssh_opts[host->n_ssh_opts++] = opt;
+}
+
+/* Insert HOST's ssh options after the command name of its transport,
+   if that is ssh. */
+void host_insert_ssh_opts (Host *host)
+{
+  const char *name = strrchr (host->transport[0], '/');
+  char **words;
+  name = name ? name + 1 : host->transport[0];
+  if (!host->n_ssh_opts)
+    return;
+  if (strcmp (name, "ssh"))
+    {
+      fprintf (stderr, "forkargs: ssh options ignored for '%s'\n",
+               host->hostname);
+      return;
+    }
+  words = calloc (host->n_transport + host->n_ssh_opts + 1, sizeof (*words));
+  words[0] = host->transport[0];
+  memcpy (words + 1, host->ssh_opts, host->n_ssh_opts * sizeof (*words));
+  memcpy (words + 1 + host->n_ssh_opts, host->transport + 1,
+          (host->n_transport - 1) * sizeof (*words));
+  free (host->transport);
+  host->transport = words;
+  host->n_transport += host->n_ssh_opts;
+}
+
+/* Apply setting KEY=VALUE to HOST. */
+void host_apply_option (Host *host, const char *key, const char *value)
+{
+  if (!strcmp (key, "cmd"))
+    host->cmd = split_words (value, &host->n_cmd);
+  else if (!strcmp (key, "transport"))
+    host_set_transport (host, value);
+  else if (!strcmp (key, "transport-hints"))
+    host->transport_hints = parse_hints (value);
+  else if (!strcmp (key, "port"))
+    host_add_ssh_opt (host, "-p", NULL, value);
+  else if (!strcmp (key, "identity"))
+    host_add_ssh_opt (host, "-i", NULL, value);
+  else if (!strcmp (key, "cipher"))
+    host_add_ssh_opt (host, "-c", NULL, value);
+  else if (!strcmp (key, "compression"))
+    host_add_ssh_opt (host, "-o", "Compression", value);
+  else if (!strcmp (key, "ipqos"))
+    host_add_ssh_opt (host, "-o", "IPQoS", value);
+  else if (!strcmp (key, "server-alive"))
+    host_add_ssh_opt (host, "-o", "ServerAliveInterval", value);
+  else if (!strcmp (key, "ssh-opt"))
+    host_add_ssh_opt (host, "-o", NULL, value);
+  else
+    {
+      fprintf (stderr, "forkargs: unknown host setting '%s'\n", key);
+      exit (2);
+    }
+}
+
+/* Does a host option for NAME apply to HOSTNAME? Options for a bare
+   machine name apply whatever user name is used, and those for '*' to
+   all remote hosts. */
+int host_option_matches (const char *name, const char *hostname)
+{
+  const char *at;
+  if (!hostname)
+    return !strcmp (name, "localhost");
+  if (!strcmp (name, "*"))
+    return 1;
+  if (!strcmp (name, hostname))
+    return 1;
+  at = strchr (hostname, '@');
+  return at && !strchr (name, '@') && !strcmp (name, at + 1);
+}
+
+/* Find the hosts table entry for HOSTNAME (NULL for local), adding
+   one if necessary. */
+int host_index (const char *hostname)
+{
+  int i;
+  for (i = 0; i < n_hosts; i++)
+    if (hostname == NULL ? hosts[i].hostname == NULL
+        : hosts[i].hostname && !strcmp (hosts[i].hostname, hostname))
+      return i;
+  hosts = realloc (hosts, sizeof (*hosts) * (++n_hosts));
+  hosts[i].hostname = hostname ? strdup (hostname) : NULL;
+  hosts[i].warm = hostname == NULL;
+  hosts[i].token_retry = 0;
+  hosts[i].budget = 0;
+  hosts[i].in_use = 0;
+  hosts[i].cmd = NULL;
+  hosts[i].n_cmd = 0;
+  hosts[i].transport = NULL;
+  hosts[i].n_transport = 0;
+  hosts[i].ssh_opts = NULL;
+  hosts[i].n_ssh_opts = 0;
+  hosts[i].running = 0;
+  hosts[i].idle_since = 0;
+  hosts[i].idle_hooked = 0;
+  hosts[i].auto_size = 0;
+  hosts[i].slot_limit = INT_MAX;
+  hosts[i].checking = 0;
+  hosts[i].probe_pid = 0;
+  hosts[i].probe_fd = -1;
+  hosts[i].probe_exited = 0;
+  hosts[i].probe_buf = NULL;
+  bucket_init (&hosts[i].start_bucket, host_start_limit.rate,
+               host_start_limit.burst);
+  {
+    int j, hints = -1;
+    for (j = 0; j < n_host_options; j++)
+      if (host_option_matches (host_options[j].hostname, hostname))
+        {
+          /* Hints apply whichever order they are given in. */
+          if (!strcmp (host_options[j].key, "transport-hints"))
+            hints = parse_hints (host_options[j].value);
+          else
+            host_apply_option (&hosts[i], host_options[j].key,
+                               host_options[j].value);
+        }
+    if (!hosts[i].transport)
+      host_set_transport (&hosts[i], hostname ? default_transport : "local");
+    if (hostname)
+      host_insert_ssh_opts (&hosts[i]);
+    if (hints != -1)
+      hosts[i].transport_hints = hints;
+  }
+  return i;
+}
+
+/* The command line for running shell command CMD on host H. */
+char **host_command (int h, const char *cmd)
+{
+  char **args = calloc (hosts[h].n_transport + 2, sizeof (*args));
+  memcpy (args, hosts[h].transport, hosts[h].n_transport * sizeof (*args));
+  args[hosts[h].n_transport] = (char *) cmd;
+  return args;
+}
+
+/* Join words ARGS[0..N) into one command line, separated by spaces. */
+char *join_words (char **args, int n)
+{
+  size_t len = 1;
+  char *str;
+  int i;
+  for (i = 0; i < n; i++)
+    len += strlen (args[i]) + 1;
+  str = malloc (len);
+  str[0] = '\0';
+  for (i = 0; i < n; i++)
+    sprintf (str + strlen (str), "%s%s", i ? " " : "", args[i]);
+  return str;
+}
+
+/* Read slot entries and per-host settings from hostfile NAME. Each
+   line is a slot entry as for '-j', optionally followed by settings
+   of the form 'key=value' (values may be quoted). Lines starting with
+   '#' are comments. The entries are added to the slots string. */
+void read_hostfile (const char *name)
+{
+  FILE *f = fopen (name, "r");
+  char line[BUFSIZ];
+  size_t len = 0;
+  char *str;
+  if (!f)
+    {
+      fprintf (stderr, "Cannot open hostfile '%s'\n", name);
+      exit (2);
+    }
+  if (slots_from_env)
+    slots_string = NULL;
+  if (slots_string)
+    len = strlen (slots_string);
+  str = malloc (len + 1);
+  strcpy (str, slots_string ? slots_string : "");
+  while (fgets (line, sizeof (line), f))
+    {
+      char *c, *settings, *entry, *hostname, *e;
+      line[strcspn (line, "\r\n")] = '\0';
+      c = line;
+      while (isspace (*c))
+        c++;
+      if (!*c || *c == '#')
+        continue;
+
+      /* Settings start at the first word containing '='. */
+      settings = NULL;
+      for (e = c; *e; e++)
+        if (isspace (*e) && isalpha (e[1]))
+          {
+            size_t word = strcspn (e + 1, " \t");
+            if (memchr (e + 1, '=', word))
+              {
+                settings = e + 1;
+                *e = '\0';
+                break;
+              }
+          }
+      entry = c;
+      str = realloc (str, len + strlen (entry) + 2);
+      sprintf (str + len, "%s%s", len ? "," : "", entry);
+      len = strlen (str);
+
+      if (!settings)
+        continue;
+      /* The host this entry is for: after any 'n*', before any ':'. */
+      hostname = strchr (entry, '*') ? strchr (entry, '*') + 1 : entry;
+      while (isspace (*hostname))
+        hostname++;
+      hostname = strndup (hostname, strcspn (hostname, ": \t"));
+      if (!*hostname || isdigit (*hostname) || !strcmp (hostname, "-"))
+        {
+          free (hostname);
+          hostname = strdup ("localhost");
+        }
+      while (*settings)
+        {
+          char *eq = strchr (settings, '=');
+          char *key, *value, *o;
+          char quote = 0;
+          if (!eq)
+            {
+              fprintf (stderr, "Bad hostfile setting: '%s'\n", settings);
+              exit (2);
+            }
+          key = strndup (settings, eq - settings);
+          value = o = strdup (eq + 1);
+          for (c = eq + 1; *c && (quote || !isspace (*c)); c++)
+            if (quote && *c == quote)
+              quote = 0;
+            else if (!quote && (*c == '"' || *c == '\''))
+              quote = *c;
+            else
+              *o++ = *c;
+          *o = '\0';
+          add_host_option (hostname, key, value);
+          free (key);
+          free (value);
+          while (isspace (*c))
+            c++;
+          settings = c;
+        }
+      free (hostname);
+    }
+  fclose (f);
+  slots_string = str;
+}
+
+char *escape_str (const char *str)
+{
+  char *escaped;
+  int len;
+  char *o;
+  len = strlen (str);
+  escaped = malloc (len * 2 + 1);
+  o = escaped;
+  while (*str)
+    {
+      if (!(isalnum (*str)
+            || *str == '_'
+            || *str == '-'
+            || *str == '/'
+            || *str == '.'))
+        *o++ = '\\';
+      *o++ = *str++;        
+    }
+  *o++ = '\0';
+  escaped = realloc (escaped, strlen (escaped) + 1);
+  return escaped;
+}
+
+void print_slots(FILE *out)
+{
+  double t0 = prof_begin ();
+  fprintf (out, "Slots:\n");
+  if (slots)
+    {
+      int i;
+      for (i = 0; i < n_slots; i++)
+        {
+          fprintf (out, "%60s %5d '%s'\n",
+                   slots[i].hostname? slots[i].hostname : "(localhost)",
+                   slots[i].cpid,
+                   (slots[i].faulted? "FAULTED" : 
+                    slots[i].job? slots[i].job->arg :
+                    "-"));
+          fprintf (out, "%60s %5s wd: '%s'\n",
+                   "", "", slots[i].working_dir);
+        }
+    }
+  else
+    {
+      fprintf (out, "(no slots)\n");
+    }
+  prof_end (PROF_TRACE, t0);
+}
+
+/* Take SLOT out of use for the rest of the run. */
+void slot_fault (int slot)
+{
+  if (slots[slot].faulted)
+    return;
+  slots[slot].faulted = 1;
+  n_faulted++;
+  if (trace)
+    fprintf (trace, "forkargs: slot %d (%s) out of use, %d of %d faulted\n",
+             slot, slots[slot].hostname ? slots[slot].hostname : "localhost",
+             n_faulted, n_slots);
+}
+
+char *working_dir_str(const char *str, int remote)
+{
+  if (str[0] == '~' && !remote)
+    {
+      const char *home = getenv("HOME");
+      int len = strlen(str) + strlen(home) + (str[1] != '/');
+      char *res = malloc(len + 1);
+      sprintf(res, "%s%s%s", home, (str[1] != '/' && str[1])?"/":"",
+              &str[1]);
+      return res;
+    }
+  else
+    return strdup(str);
+}
+
+/* Parse the slot description STR, as given to -j, and add its slots
+   to the end of the table, running ARGS. Returns 0, or if STR is bad,
+   reports it and returns the exit status to give, having added no
+   slots. */
+int add_slots (const char *str, char **args, int n_args)
+{
+  const char *c = str;
+  int i, first = n_slots, first_host = n_hosts;
+  while (*c)
+    {
+      int num_slots = 1;
+      int auto_size = 0;
+      char hostname[BUFSIZ] = "localhost";
+      char working_dir[BUFSIZ] = "";
+
+      while (*c && isspace(*c))
+        c++;
+
+      /* 'auto' '*' hostname ? */
+      if (!strncmp (c, "auto", 4))
+        {
+          const char *c2 = c + 4;
+          while (*c2 && isspace(*c2))
+            c2++;
+          if (*c2 == '*')
+            {
+              auto_size = 1;
+              c = c2 + 1;
+              while (*c && isspace(*c))
+                c++;
+            }
+        }
+
+      /* int '*' hostname ? */
+      if (*c && isdigit(*c))
+        {
+          const char *c2 = c;
+          char num[BUFSIZ];
+          i = 0;
+          while (*c2 && isdigit(*c2))
+            num[i++ % BUFSIZ] = *c2++;
+          num[i++] = '\0';
+          while (*c2 && isspace(*c2))
+            c2++;
+          if (*c2 && *c2 == '*')
+            {
+              num_slots = atol(num);
+              c = c2+1;
+              while (*c && isspace(*c))
+                c++;
+            }
+          else if (!*c2 || *c2 == ',')
+            {
+              num_slots = atol (num);
+              c = c2;       /* don't skip the ',' if there is one. */
+            }
+        }
+
+      if (*c && *c != ',' && *c != ':')
+        {
+          /* Hostname */
+          i = 0;
+          while (*c && (isalnum(*c) || *c == '-' || *c == '.'
+                        || *c == '@' || *c == '_'))
+            hostname[i++] = *c++;
+          hostname[i++] = '\0';
+          
+          if (i == 1)
+            {
+              fprintf (stderr, "Bad hostname: '%s'\n", c);
+              n_slots = first;
+              n_hosts = first_host;
+              return 2;
+            }
+        }
+
+      if (*c == ':')
+        {
+          /* Working directory */
+          c++;
+          i = 0;
+          while (*c && *c != ',')
+            working_dir[i++] = *c++;
+          working_dir[i++] = '\0';
+        }
+      
+      /* Set up NUM_SLOTS slots for this entry. */
+      for (i = 0; i < num_slots; i++)
+        {
+          int a, ai, h, remote_a = 0;
+          char **slot_args;
+          char **cmd = args;
+          int n_cmd = n_args;
+          char *host = NULL;
+          char *wd = NULL;
+          if (strcmp(hostname, "localhost") && strcmp(hostname, "-"))
+            host = strdup(hostname);
+          if (working_dir[0])
+            {
+              wd = working_dir_str(working_dir, host != NULL);
+            }
+          h = host_index (host);
+          if (auto_size)
+            hosts[h].auto_size = 1;
+          if (hosts[h].cmd)
+            {
+              /* This host runs its own version of the command. */
+              cmd = hosts[h].cmd;
+              n_cmd = hosts[h].n_cmd;
+            }
+          a = 0;
+          slot_args = calloc (n_cmd + hosts[h].n_transport + 2 + 3,
+                              sizeof(*slot_args));
+
+          /* For remote slots, we set up some arguments
+             appropriately here: constructing the SSH command
+             arguments so they're ready to go, rather than
+             deferring this until we're ready to exec(). */
+          if (host)
+            {
+              for (ai = 0; ai < hosts[h].n_transport; ai++)
+                slot_args[a++] = hosts[h].transport[ai];
+              remote_a = a;
+              if (wd)
+                {
+                  slot_args[a++] = "cd";
+                  slot_args[a++] = escape_str(wd);
+                  slot_args[a++] = ";";
+                }
+
+              for (ai = 0; ai < n_cmd; ai++)
+                slot_args[a++] = escape_str (cmd[ai]);
+            }
+          else
+            for (ai = 0; ai < n_cmd; ai++)
+              slot_args[a++] = cmd[ai];
+
+          slots = realloc(slots, sizeof(*slots) * (++n_slots));
+          slots[n_slots -1].hostname = host;
+          slots[n_slots -1].host = h;
+          slots[n_slots -1].host_rank = 0;
+          for (ai = 0; ai < n_slots - 1; ai++)
+            if (slots[ai].host == h)
+              slots[n_slots -1].host_rank++;
+          slots[n_slots -1].cpid = -1;
+          slots[n_slots -1].args = slot_args;
+          slots[n_slots -1].n_args = a;
+          slots[n_slots -1].cmd_arg = a - n_cmd;
+          slots[n_slots -1].remote_arg = remote_a;
+          slots[n_slots -1].job = NULL;
+          slots[n_slots -1].remote_slot = host != NULL;
+          slots[n_slots -1].faulted = 0;
+          slots[n_slots -1].token_held = 0;
+          slots[n_slots -1].sandbox_pid = 0;
+          slots[n_slots -1].scratch_root = NULL;
+          slots[n_slots -1].zygote_pid = 0;
+          slots[n_slots -1].zygote_fd = -1;
+          slots[n_slots -1].batch_fd = -1;
+          slots[n_slots -1].batch_buf = NULL;
+          slots[n_slots -1].warm_pid = 0;
+          slots[n_slots -1].warm_fd = -1;
+          slots[n_slots -1].warm_wanted = 0;
+          slots[n_slots -1].warm_started = 0;
+          slots[n_slots -1].connect_at = 0;
+          slots[n_slots -1].scratch_gen = 0;
+          slots[n_slots -1].started = 0;
+          slots[n_slots -1].spawn_at = 0;
+          slots[n_slots -1].working_dir = wd;
+        }
+
+      while (*c && isspace(*c))
+        c++;
+      
+      /* Comma separates slots */
+      if (*c)
+        if (*c == ',' && *(c + 1))
+          c++;              /* and then continue */
+        else
+          {
+            fprintf (stderr, "Bad slot description at '%s'\n", c);
+            n_slots = first;
+            n_hosts = first_host;
+            return 1;
+          }
+      else
+        break;
+
+    } /* while (*c) */
+  return 0;
+}
+
+/* Initialise slots */
+void setup_slots(const char *str, char ** args, int n_args)
+{
+  int i;
+  n_slots = 1;                  /* default to 1 slot */
+  /* On platforms that can report the number of CPUs this way, use
+     that as a default. */
+#if defined(_SC_NPROCESSORS_ONLN)
+  n_slots = sysconf(_SC_NPROCESSORS_ONLN);
+  if (trace)
+    fprintf (trace, "forkargs: defaulting to %d slots\n", n_slots);
+#endif
+  host_index (NULL);
+  slots = calloc (sizeof (Slot), n_slots);
+  for (i = 0; i < n_slots; i++)
+    {
+      slots[i].hostname = NULL;
+      slots[i].host = 0;
+      slots[i].host_rank = i;
+      slots[i].cpid = -1;
+      slots[i].zygote_fd = -1;
+      slots[i].batch_fd = -1;
+      slots[i].warm_fd = -1;
+      slots[i].job = NULL;
+      slots[i].args = args;
+      slots[i].n_args = n_args;
+      if (hosts[0].cmd)
+        {
+          /* Local command override: a private argv per slot. */
+          slots[i].args = calloc (hosts[0].n_cmd + 2, sizeof (char *));
+          memcpy (slots[i].args, hosts[0].cmd,
+                  hosts[0].n_cmd * sizeof (char *));
+          slots[i].n_args = hosts[0].n_cmd;
+        }
+    }
+
+  /* Parse the slots string and set up the slots it describes instead. */
+  if (str)
+    {
+      n_slots = 0;
+      i = add_slots (str, args, n_args);
+      if (i)
+        exit (i);
+    }
+
+  /* Synchronise working directory */
+  if (sync_working_dirs)
+    {
+      char **args;
+      char *local_args[] = {
+        "rsync", "--delete", "-ravu", "./", NULL, NULL
+      };
+      const int local_args_dest_i = 4;
+      char *remote_args[] = {
+        "rsync", "--delete", "-e", "ssh", "-ravu", "./", NULL, NULL
+      };
+      const int remote_args_dest_i = 6;
+      assert(local_args[local_args_dest_i] == NULL
+             && local_args[local_args_dest_i+1] == NULL);
+      assert(remote_args[remote_args_dest_i] == NULL
+             && remote_args[remote_args_dest_i+1] == NULL);
+      /* Check that all slots have a specified working directory */
+      for (i = 0; i < n_slots; i++)
+        {
+          if (slots[i].working_dir == NULL)
+            {
+              fprintf (stderr, ("forkargs: must specify working directory "
+                                "when synchronising work dirs\n"));
+            }
+        }
+      for (i = 0; i < n_slots; i++)
+        {
+          int j;
+          /* Check that we haven't already encountered this host:dir pair before. */
+          for (j = 0; j < i; j++)
+            if (!strcmp (slots[i].hostname, slots[j].hostname)
+                && !strcmp (slots[i].working_dir, slots[j].working_dir))
+              break;
+          if (i != j)
+            continue;
+          assert (0);
+        }
+    }
+}
+
+static char *
+read_line_offset (FILE *in,
+                  size_t offset)
+{
+  char buffer[BUFSIZ];
+  char *result = NULL;
+  if (!feof(in)
+      && fgets(buffer, BUFSIZ, in))
+    {
+      size_t len = strlen(buffer);
+      if (strstr(buffer, "\n") == NULL)
+        {
+          /* No newline in this, so get the rest of the string. */
+          result = read_line_offset(in, offset + len);
+        }
+      else
+        {
+          /* We've read a newline. Allocate a buffer and set the
+             terminating end of line character. */
+          result = malloc (len + 1 + offset);
+          result[len + offset] = '\0';
+        }
+
+      /* Copy the buffer into the result. */
+      strncpy(&(result[offset]), buffer, len);
+    }
+  return result;
+}
+
+
+char *
+read_line (FILE *in)
+{
+  char *line;
+  if (FAULT ("slow-input"))
+    usleep (rand () % 100000);
+  line = read_line_offset (in, 0);
+  if (line)
+    {
+      input_seq++;
+      input_line_length = strlen (line);
+      input_offset += input_line_length;
+    }
+  return line;
+}
+
+/* Return all held jobserver tokens. */
+void jobserver_release_all (void)
+{
+  while (n_jobserver_tokens > 0)
+    if (write (jobserver_wfd, &jobserver_tokens[--n_jobserver_tokens], 1)
+        == -1 && errno == EINTR)
+      n_jobserver_tokens++;
+}
+
+/* Open a private non-blocking read side for jobserver pipe FD, so
+   that non-blocking reads do not disturb other clients sharing the
+   pipe. Falls back to FD itself. */
+int jobserver_private_fd (int fd)
+{
+  char path[64];
+  int rfd;
+  sprintf (path, "/proc/self/fd/%d", fd);
+  rfd = open (path, O_RDONLY | O_NONBLOCK);
+  if (rfd == -1)
+    return fd;
+  fcntl (rfd, F_SETFD, FD_CLOEXEC);
+  return rfd;
+}
+
+/* Join the jobserver named in MAKEFLAGS, if any. */
+void jobserver_client_setup (void)
+{
+  const char *flags = getenv ("MAKEFLAGS");
+  const char *auth = NULL, *c;
+  int r, w;
+  if (!flags || !use_jobserver || jobserver_server)
+    return;
+  /* The last occurrence takes precedence. */
+  for (c = flags; (c = strstr (c, "--jobserver-")); c++)
+    if (!strncmp (c, "--jobserver-auth=", 17))
+      auth = c + 17;
+    else if (!strncmp (c, "--jobserver-fds=", 16))
+      auth = c + 16;
+  if (!auth)
+    return;
+  if (!strncmp (auth, "fifo:", 5))
+    {
+      char *path = strndup (auth + 5, strcspn (auth + 5, " "));
+      jobserver_rfd = open (path, O_RDONLY | O_NONBLOCK);
+      jobserver_wfd = open (path, O_WRONLY);
+      if (jobserver_rfd == -1 || jobserver_wfd == -1)
+        {
+          fprintf (stderr, "forkargs: cannot open jobserver fifo '%s'\n",
+                   path);
+          exit (1);
+        }
+      fcntl (jobserver_rfd, F_SETFD, FD_CLOEXEC);
+      fcntl (jobserver_wfd, F_SETFD, FD_CLOEXEC);
+      free (path);
+    }
+  else if (sscanf (auth, "%d,%d", &r, &w) == 2)
+    {
+      if (r < 0 || w < 0 || fcntl (r, F_GETFD) == -1
+          || fcntl (w, F_GETFD) == -1)
+        {
+          /* make did not pass the descriptors to us (eg. the recipe
+             was not marked with '+'), so run without it. */
+          if (verbose)
+            fprintf (stderr, "forkargs: jobserver unavailable\n");
+          return;
+        }
+      jobserver_rfd = jobserver_private_fd (r);
+      jobserver_wfd = w;
+    }
+  else
+    return;
+  if (trace)
+    fprintf (trace, "forkargs: using jobserver (%d,%d)\n",
+             jobserver_rfd, jobserver_wfd);
+  atexit (jobserver_release_all);
+}
+
+/* Become a jobserver with N tokens in total, exporting it to children
+   through MAKEFLAGS. */
+void jobserver_server_setup (int n)
+{
+  int fds[2];
+  int i;
+  const char *old = getenv ("MAKEFLAGS");
+  char *flags;
+  if (pipe (fds) == -1)
+    {
+      perror ("forkargs: jobserver");
+      exit (1);
+    }
+  /* We hold one token implicitly. */
+  for (i = 0; i < n - 1; i++)
+    if (write (fds[1], "+", 1) != 1)
+      {
+        perror ("forkargs: jobserver");
+        exit (1);
+      }
+  flags = malloc ((old ? strlen (old) : 0) + 100);
+  sprintf (flags, "%s%s-j%d --jobserver-auth=%d,%d", old ? old : "",
+           old && *old ? " " : "", n, fds[0], fds[1]);
+  setenv ("MAKEFLAGS", flags, 1);
+  free (flags);
+  jobserver_rfd = jobserver_private_fd (fds[0]);
+  jobserver_wfd = fds[1];
+  atexit (jobserver_release_all);
+}
+
+/* Try to get a jobserver token for another job, if one is needed.
+   Returns 1 on success; otherwise watches the jobserver for tokens
+   and returns 0. */
+int jobserver_acquire (void)
+{
+  char token;
+  ssize_t n;
+  if (jobserver_rfd == -1 || n_jobserver_tokens >= n_active)
+    return 1;
+  n = -1;
+  if (fcntl (jobserver_rfd, F_GETFL) & O_NONBLOCK)
+    n = read (jobserver_rfd, &token, 1);
+  else
+    {
+      /* Shared blocking descriptor: only read when it looks ready.
+         Another client may beat us to it, so this can still block
+         until a token turns up. */
+      fd_set fds;
+      struct timeval tv = { 0, 0 };
+      FD_ZERO (&fds);
+      FD_SET (jobserver_rfd, &fds);
+      if (select (jobserver_rfd + 1, &fds, NULL, NULL, &tv) > 0)
+        n = read (jobserver_rfd, &token, 1);
+    }
+  if (n == 1)
+    {
+      jobserver_tokens = realloc (jobserver_tokens, n_jobserver_tokens + 1);
+      jobserver_tokens[n_jobserver_tokens++] = token;
+      return 1;
+    }
+  watch_fd (jobserver_rfd);
+  return 0;
+}
+
+/* Return tokens no longer needed by the active jobs. */
+void jobserver_release_surplus (void)
+{
+  while (n_jobserver_tokens > 0 && n_jobserver_tokens >= n_active)
+    {
+      if (write (jobserver_wfd, &jobserver_tokens[n_jobserver_tokens - 1], 1)
+          == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          perror ("forkargs: jobserver");
+          exit (1);
+        }
+      n_jobserver_tokens--;
+    }
+}
+
+/* The token server key for HOSTNAME: the machine, without any user
+   name. */
+const char *token_key (const char *hostname)
+{
+  const char *at = strchr (hostname, '@');
+  return at ? at + 1 : hostname;
+}
+
+/* Connect to the token server at token_socket_path. */
+void token_connect (void)
+{
+  struct sockaddr_un addr;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, token_socket_path, sizeof (addr.sun_path) - 1);
+  if (fd == -1
+      || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+    {
+      fprintf (stderr, "forkargs: cannot connect to token server '%s': %s\n",
+               token_socket_path, strerror (errno));
+      exit (1);
+    }
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  token_socket = fdopen (fd, "r+");
+  setvbuf (token_socket, NULL, _IOLBF, 0);
+}
+
+/* Lost the token server: carry on without its limits. */
+void token_lost (void)
+{
+  fprintf (stderr, "forkargs: lost token server, continuing without it\n");
+  fclose (token_socket);
+  token_socket = NULL;
+}
+
+/* Get a token for a job on remote SLOT at time T. Returns 1 if the job
+   may start, 0 if the host's budget is exhausted for now. */
+int token_acquire (int slot, double t)
+{
+  Host *host = &hosts[slots[slot].host];
+  char reply[64];
+  if (!token_socket || !slots[slot].remote_slot)
+    return 1;
+  if (t < host->token_retry)
+    return 0;
+  fprintf (token_socket, "ACQ %s\n", token_key (host->hostname));
+  if (!fgets (reply, sizeof (reply), token_socket))
+    {
+      token_lost ();
+      return 1;
+    }
+  if (!strcmp (reply, "WAIT\n"))
+    {
+      host->token_retry = t + TOKEN_RETRY;
+      return 0;
+    }
+  /* "OK", or "NONE" for hosts the server does not limit. */
+  slots[slot].token_held = !strcmp (reply, "OK\n");
+  return 1;
+}
+
+void token_release (int slot)
+{
+  if (!slots[slot].token_held)
+    return;
+  slots[slot].token_held = 0;
+  if (token_socket
+      && fprintf (token_socket, "REL %s\n",
+                  token_key (slots[slot].hostname)) < 0)
+    token_lost ();
+}
+
+/* Run as a token server on Unix socket PATH, handing out tokens for
+   the slots in the slot table, until interrupted. Each client line
+   'ACQ <host>' is answered 'OK', 'WAIT' or 'NONE'; 'REL <host>'
+   returns a token. A client's tokens are returned when it
+   disconnects. */
+void token_server (const char *path)
+{
+  typedef struct
+  {
+    int fd;
+    char buf[BUFSIZ];
+    size_t len;
+    int *held;                  /* tokens held per host */
+  } Client;
+  Client *clients = NULL;
+  int n_clients = 0;
+  struct sockaddr_un addr;
+  int lfd, i, h;
+
+  /* Budgets come from the slot definitions. */
+  for (i = 0; i < n_slots; i++)
+    hosts[slots[i].host].budget++;
+  for (h = 0; h < n_hosts; h++)
+    if (hosts[h].hostname)
+      {
+        char *key = strdup (token_key (hosts[h].hostname));
+        free (hosts[h].hostname);
+        hosts[h].hostname = key;
+      }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  unlink (path);
+  lfd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (lfd == -1 || bind (lfd, (struct sockaddr *) &addr, sizeof (addr)) == -1
+      || listen (lfd, 16) == -1)
+    {
+      fprintf (stderr, "forkargs: cannot listen on '%s': %s\n",
+               path, strerror (errno));
+      exit (1);
+    }
+  signal (SIGPIPE, SIG_IGN);
+  if (verbose)
+    fprintf (stderr, "forkargs: token server listening on '%s'\n", path);
+
+  while (!interrupted)
+    {
+      fd_set fds;
+      int max_fd = lfd;
+      FD_ZERO (&fds);
+      FD_SET (lfd, &fds);
+      for (i = 0; i < n_clients; i++)
+        {
+          FD_SET (clients[i].fd, &fds);
+          if (clients[i].fd > max_fd)
+            max_fd = clients[i].fd;
+        }
+      if (select (max_fd + 1, &fds, NULL, NULL, NULL) == -1)
+        continue;
+
+      if (FD_ISSET (lfd, &fds))
+        {
+          int fd = accept (lfd, NULL, NULL);
+          if (fd != -1)
+            {
+              clients = realloc (clients, sizeof (*clients) * (n_clients + 1));
+              clients[n_clients].fd = fd;
+              clients[n_clients].len = 0;
+              clients[n_clients].held = calloc (n_hosts, sizeof (int));
+              n_clients++;
+            }
+        }
+
+      for (i = 0; i < n_clients; i++)
+        {
+          Client *c = &clients[i];
+          ssize_t n;
+          char *nl;
+          if (!FD_ISSET (c->fd, &fds))
+            continue;
+          n = read (c->fd, c->buf + c->len, sizeof (c->buf) - 1 - c->len);
+          if (n <= 0)
+            {
+              /* Disconnected: return everything it held. */
+              for (h = 0; h < n_hosts; h++)
+                hosts[h].in_use -= c->held[h];
+              if (trace)
+                fprintf (trace, "forkargs: token client %d gone\n", c->fd);
+              close (c->fd);
+              free (c->held);
+              clients[i--] = clients[--n_clients];
+              continue;
+            }
+          c->len += n;
+          c->buf[c->len] = '\0';
+          while ((nl = strchr (c->buf, '\n')))
+            {
+              const char *reply = NULL;
+              *nl = '\0';
+              for (h = 0; h < n_hosts; h++)
+                if (hosts[h].hostname
+                    && !strcmp (hosts[h].hostname, c->buf + 4))
+                  break;
+              if (!strncmp (c->buf, "ACQ ", 4))
+                {
+                  if (h == n_hosts)
+                    reply = "NONE\n";
+                  else if (hosts[h].in_use >= hosts[h].budget)
+                    reply = "WAIT\n";
+                  else
+                    {
+                      hosts[h].in_use++;
+                      c->held[h]++;
+                      reply = "OK\n";
+                    }
+                }
+              else if (!strncmp (c->buf, "REL ", 4) && h < n_hosts
+                       && c->held[h] > 0)
+                {
+                  hosts[h].in_use--;
+                  c->held[h]--;
+                }
+              if (trace)
+                fprintf (trace, "forkargs: token client %d: %s -> %s",
+                         c->fd, c->buf, reply ? reply : "\n");
+              if (reply)
+                {
+                  /* A failure will be noticed as a disconnect. */
+                  ssize_t n = write (c->fd, reply, strlen (reply));
+                  (void) n;
+                }
+              c->len -= nl + 1 - c->buf;
+              memmove (c->buf, nl + 1, c->len + 1);
+            }
+          if (c->len == sizeof (c->buf) - 1)
+            c->len = 0;         /* overlong garbage */
+        }
+    }
+  unlink (path);
+  exit (0);
+}
+
+#if defined(__linux__)
+/* Mount a size-limited tmpfs for scratch space at PATH. */
+static int scratch_mount (const char *path)
+{
+  char options[BUFSIZ];
+  snprintf (options, sizeof (options), "size=%s,mode=0700", scratch_size);
+  return mount ("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, options);
+}
+
+/* Write STR to FILE, for the namespace id maps. */
+static int write_file (const char *file, const char *str)
+{
+  int fd = open (file, O_WRONLY);
+  int ok = fd != -1 && write (fd, str, strlen (str)) == (ssize_t) strlen (str);
+  if (fd != -1)
+    close (fd);
+  return ok;
+}
+
+/* Remount mount point PATH read-only, keeping the flags it has (the
+   kernel refuses to clear locked flags in a user namespace). */
+static int remount_ro (const char *path)
+{
+  struct statvfs st;
+  unsigned long flags = MS_REMOUNT | MS_BIND | MS_RDONLY;
+  if (statvfs (path, &st) == -1)
+    return -1;
+  if (st.f_flag & ST_NOSUID)
+    flags |= MS_NOSUID;
+  if (st.f_flag & ST_NODEV)
+    flags |= MS_NODEV;
+  if (st.f_flag & ST_NOEXEC)
+    flags |= MS_NOEXEC;
+  if (st.f_flag & ST_NOATIME)
+    flags |= MS_NOATIME;
+  if (st.f_flag & ST_NODIRATIME)
+    flags |= MS_NODIRATIME;
+  if (st.f_flag & ST_RELATIME)
+    flags |= MS_RELATIME;
+  return mount (NULL, path, NULL, flags, NULL);
+}
+
+/* Make a writable bind mount of directory PATH onto itself,
+   returning a descriptor for it, or -1. */
+static int bind_writable (const char *path)
+{
+  if (mount (path, path, NULL, MS_BIND | MS_REC, NULL) == -1)
+    return -1;
+  return open (path, O_PATH | O_DIRECTORY);
+}
+
+/* Reattach writable bind FD at PATH, if PATH was hidden by the
+   private /tmp. */
+static int rebind_writable (int fd, const char *path)
+{
+  char proc[64], *p, *dir;
+  struct stat st;
+  if (stat (path, &st) == 0)
+    return 0;
+  dir = strdup (path);
+  for (p = dir + 1; *p; p++)
+    if (*p == '/')
+      {
+        *p = '\0';
+        mkdir (dir, 0700);
+        *p = '/';
+      }
+  mkdir (dir, 0700);
+  free (dir);
+  sprintf (proc, "/proc/self/fd/%d", fd);
+  return mount (proc, path, NULL, MS_BIND | MS_REC, NULL);
+}
+
+/* In the sandbox holder: make every existing mount read-only, except
+   the working directories, and mount a private /tmp. */
+static int sandbox_mounts (int slot)
+{
+  FILE *mounts;
+  char **points = NULL;
+  int n_points = 0, i;
+  int cwd_fd, wd_fd = -1, sc_fd = -1;
+  char dev[BUFSIZ], point[BUFSIZ];
+
+  if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1)
+    return -1;
+
+  mounts = fopen ("/proc/self/mounts", "r");
+  if (!mounts)
+    return -1;
+  while (fscanf (mounts, "%s %s %*[^\n]", dev, point) == 2)
+    {
+      /* Undo the octal escapes of spaces etc. */
+      char *in = point, *out = point;
+      while (*in)
+        if (in[0] == '\\' && isdigit (in[1]) && isdigit (in[2])
+            && isdigit (in[3]))
+          {
+            *out++ = (in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0');
+            in += 4;
+          }
+        else
+          *out++ = *in++;
+      *out = '\0';
+      points = realloc (points, sizeof (*points) * (n_points + 1));
+      points[n_points++] = strdup (point);
+    }
+  fclose (mounts);
+
+  /* Bind mounts made now stay writable when the originals are made
+     read-only. */
+  if ((cwd_fd = bind_writable (sandbox_cwd)) == -1)
+    return -1;
+  if (slots[slot].working_dir
+      && (wd_fd = bind_writable (slots[slot].working_dir)) == -1)
+    return -1;
+  if (slots[slot].scratch_root
+      && (sc_fd = bind_writable (slots[slot].scratch_root)) == -1)
+    return -1;
+
+  for (i = 0; i < n_points; i++)
+    if (remount_ro (points[i]) == -1 && !strcmp (points[i], "/"))
+      return -1;
+
+  if (mount ("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV,
+             "mode=1777") == -1)
+    return -1;
+  if (rebind_writable (cwd_fd, sandbox_cwd) == -1
+      || (wd_fd != -1
+          && rebind_writable (wd_fd, slots[slot].working_dir) == -1)
+      || (sc_fd != -1
+          && rebind_writable (sc_fd, slots[slot].scratch_root) == -1))
+    return -1;
+  close (cwd_fd);
+  if (wd_fd != -1)
+    close (wd_fd);
+  if (sc_fd != -1)
+    {
+      close (sc_fd);
+      if (scratch_size && scratch_mount (slots[slot].scratch_root) == -1)
+        return -1;
+    }
+  return 0;
+}
+
+/* Bring up the loopback interface in a new network namespace. */
+static void sandbox_loopback (void)
+{
+  struct ifreq ifr;
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1)
+    return;
+  memset (&ifr, 0, sizeof (ifr));
+  strcpy (ifr.ifr_name, "lo");
+  if (ioctl (fd, SIOCGIFFLAGS, &ifr) == 0)
+    {
+      ifr.ifr_flags |= IFF_UP;
+      ioctl (fd, SIOCSIFFLAGS, &ifr);
+    }
+  close (fd);
+}
+
+/* Create the namespaces for local SLOT, held open by a child process
+   that sleeps until forkargs exits. Jobs for the slot join them with
+   setns(), which is much cheaper than unsharing per job. */
+void sandbox_setup_slot (int slot)
+{
+  int ready[2];
+  char c = 1;
+  uid_t uid = geteuid ();
+  gid_t gid = getegid ();
+  pid_t pid;
+
+  if (pipe (ready) == -1 || (pid = fork ()) == -1)
+    {
+      perror ("forkargs: sandbox");
+      exit (1);
+    }
+  if (pid == 0)
+    {
+      int flags = CLONE_NEWNS | (sandbox_net ? CLONE_NEWNET : 0);
+      char map[64];
+      close (ready[0]);
+      prctl (PR_SET_PDEATHSIG, SIGKILL);
+      signal (SIGINT, SIG_IGN);
+      if (uid != 0)
+        flags |= CLONE_NEWUSER;
+      c = 0;
+      if (unshare (flags) == 0)
+        {
+          c = 1;
+          if (uid != 0)
+            {
+              sprintf (map, "%d %d 1\n", (int) uid, (int) uid);
+              c = write_file ("/proc/self/uid_map", map)
+                && write_file ("/proc/self/setgroups", "deny");
+              sprintf (map, "%d %d 1\n", (int) gid, (int) gid);
+              c = c && write_file ("/proc/self/gid_map", map);
+            }
+          c = c && sandbox_mounts (slot) == 0;
+          if (c && sandbox_net)
+            sandbox_loopback ();
+        }
+      if (!c)
+        perror ("forkargs: sandbox");
+      if (write (ready[1], &c, 1) != 1 || !c)
+        _exit (1);
+      close (ready[1]);
+      for (;;)
+        pause ();
+    }
+  close (ready[1]);
+  if (read (ready[0], &c, 1) != 1 || !c)
+    {
+      fprintf (stderr, "forkargs: cannot create sandbox for slot %d\n", slot);
+      exit (1);
+    }
+  close (ready[0]);
+  slots[slot].sandbox_pid = pid;
+}
+
+/* Child side: join the sandbox of SLOT. Failures leave with _exit(),
+   as exit() would run sandbox_kill() and take every slot's sandbox
+   down. */
+void sandbox_enter (int slot)
+{
+  static const char *const ns[] = { "user", "mnt", "net" };
+  char path[64];
+  int i, fd;
+  for (i = 0; i < 3; i++)
+    {
+      if ((i == 0 && geteuid () == 0) || (i == 2 && !sandbox_net))
+        continue;
+      sprintf (path, "/proc/%d/ns/%s", (int) slots[slot].sandbox_pid, ns[i]);
+      fd = open (path, O_RDONLY);
+      if (fd == -1 || setns (fd, 0) == -1)
+        {
+          perror ("forkargs: entering sandbox");
+          _exit (1);
+        }
+      close (fd);
+    }
+  /* Joining the mount namespace moved us to its root. */
+  if (chdir (sandbox_cwd) == -1)
+    {
+      perror (sandbox_cwd);
+      _exit (1);
+    }
+}
+
+void sandbox_kill (void)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].sandbox_pid > 0)
+      kill (slots[i].sandbox_pid, SIGKILL);
+}
+#endif
+
+/* Set up sandboxes for all local slots. */
+void sandbox_setup (void)
+{
+#if defined(__linux__)
+  int i;
+  sandbox_cwd = getcwd (NULL, 0);
+  for (i = 0; i < n_slots; i++)
+    if (!slots[i].remote_slot && !slots[i].faulted)
+      sandbox_setup_slot (i);
+  atexit (sandbox_kill);
+#else
+  fprintf (stderr, "forkargs: --sandbox is not supported on this system\n");
+  exit (2);
+#endif
+}
+
+/* The path of NAME in SLOT's scratch root, as seen from forkargs
+   (the root may only exist inside the slot's sandbox). */
+char *scratch_path (int slot, const char *name)
+{
+  char *path = malloc (strlen (slots[slot].scratch_root) + strlen (name)
+                       + 64);
+  if (slots[slot].sandbox_pid > 0)
+    sprintf (path, "/proc/%d/root%s/%s", (int) slots[slot].sandbox_pid,
+             slots[slot].scratch_root, name);
+  else
+    sprintf (path, "%s/%s", slots[slot].scratch_root, name);
+  return path;
+}
+
+/* Delete PATH in the background. */
+void spawn_cleaner (char *path)
+{
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      signal (SIGINT, SIG_IGN);
+      execlp ("rm", "rm", "-rf", path, (char *) NULL);
+      _exit (1);
+    }
+  if (pid == -1)
+    {
+      /* No process to spare: leave it for scratch_finish(). */
+      if (verbose)
+        fprintf (stderr, "forkargs: cannot remove '%s' yet\n", path);
+      return;
+    }
+  cleaners = realloc (cleaners, sizeof (*cleaners) * (n_cleaners + 1));
+  cleaners[n_cleaners++] = pid;
+}
+
+/* Delete PATH, waiting until it has gone. Returns 0 on success. */
+int remove_now (const char *path)
+{
+  int status;
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      execlp ("rm", "rm", "-rf", path, (char *) NULL);
+      _exit (1);
+    }
+  if (pid == -1)
+    return -1;
+  while (waitpid (pid, &status, 0) == -1)
+    if (errno != EINTR)
+      return -1;
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0 ? 0 : -1;
+}
+
+/* Give SLOT an empty scratch directory for its next job. The old one
+   is renamed out of the way and deleted asynchronously, so a large
+   recursive delete never delays the next spawn. With --scratch-size
+   it is deleted in place instead, as trash left in the tmpfs would eat
+   into the next job's space; so it is if it cannot be renamed, and
+   failing that it is reused. */
+void scratch_recycle (int slot)
+{
+  char *scratch, *trash;
+  char name[64];
+  if (!slots[slot].scratch_root)
+    return;
+  scratch = scratch_path (slot, "scratch");
+  if (rmdir (scratch) == -1 && errno != ENOENT)
+    {
+      sprintf (name, "trash.%d", slots[slot].scratch_gen++);
+      trash = scratch_path (slot, name);
+      if (!scratch_size && rename (scratch, trash) == 0)
+        spawn_cleaner (trash);
+      else if (remove_now (scratch) == -1)
+        fprintf (stderr, "forkargs: cannot empty scratch directory '%s'\n",
+                 scratch);
+      free (trash);
+    }
+  if (mkdir (scratch, 0700) == -1 && errno != EEXIST)
+    {
+      fprintf (stderr, "forkargs: cannot create scratch directory '%s': %s\n",
+               scratch, strerror (errno));
+      slot_fault (slot);
+    }
+  free (scratch);
+}
+
+/* Create the scratch root of local slot I. */
+void scratch_setup_slot (int i)
+{
+  char *root = malloc (strlen (scratch_base) + 64);
+  sprintf (root, "%s/forkargs-%d-%d", scratch_base, (int) getpid (), i);
+  if (mkdir (root, 0700) == -1)
+    {
+      fprintf (stderr, "forkargs: cannot create '%s': %s\n",
+               root, strerror (errno));
+      exit (1);
+    }
+  slots[i].scratch_root = root;
+#if defined(__linux__)
+  if (scratch_size && !sandbox && scratch_mount (root) == -1)
+    {
+      fprintf (stderr, ("forkargs: cannot mount tmpfs on '%s': %s"
+                        " (--scratch-size needs root or --sandbox)\n"),
+               root, strerror (errno));
+      exit (1);
+    }
+#else
+  if (scratch_size)
+    {
+      fprintf (stderr, "forkargs: --scratch-size is not supported\n");
+      exit (2);
+    }
+#endif
+}
+
+/* Create the scratch roots of the local slots. Called before sandboxes
+   are set up, which mount them privately. */
+void scratch_setup (void)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (!slots[i].remote_slot)
+      scratch_setup_slot (i);
+}
+
+/* Create the first scratch directories. Called after sandboxes are
+   set up. */
+void scratch_start (void)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    scratch_recycle (i);
+}
+
+/* Wait for cleaners and remove the scratch roots. */
+void scratch_finish (void)
+{
+  int i, status;
+  for (i = 0; i < n_cleaners; i++)
+    waitpid (cleaners[i], &status, 0);
+  n_cleaners = 0;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].scratch_root)
+      {
+#if defined(__linux__)
+        if (scratch_size && !sandbox)
+          umount (slots[i].scratch_root);
+#endif
+        /* A sandbox's tmpfs goes with its namespace; this removes what
+           is on the real filesystem. */
+        spawn_cleaner (slots[i].scratch_root);
+      }
+  for (i = 0; i < n_cleaners; i++)
+    waitpid (cleaners[i], &status, 0);
+  n_cleaners = 0;
+}
+
+void help (void)
+{
+  fprintf (stdout, ("Syntax: forkargs -t<out> -j<n>\n"));
+  fprintf (stdout, (" -j<n>   Maximum of <n> parallel jobs\n"));
+  fprintf (stdout, (" -k      Continue on errors.\n"));
+  fprintf (stdout, (" -v      Verbose\n"));
+  fprintf (stdout, (" -t<out> trace process control info to <out>\n"));
+  fprintf (stdout, (" -n      "
+                    "Do not test accessibility of remote machines"
+                    " before issuing commands to them.\n"));
+  fprintf (stdout, (" -f<file> Take input arguments from file rather than"
+                    " stdin.\n"));
+  fprintf (stdout, (" -sync   Synchronise working directories before (and \n"
+                    "         after running)\n"));
+  fprintf (stdout, (" --max-start-rate <r>[:<burst>]\n"
+                    "         Start at most <r> jobs per second overall.\n"));
+  fprintf (stdout, (" --host-start-rate <r>[:<burst>]\n"
+                    "         Start at most <r> jobs per second on each host.\n"));
+  fprintf (stdout, (" --max-connecting <n>\n"
+                    "         Limit remote jobs in connection setup to <n>.\n"));
+  fprintf (stdout, (" --connect-time <s>\n"
+                    "         Seconds a remote job counts as connecting"
+                    " (default 1).\n"));
+  fprintf (stdout, (" --ramp-up linear:<s>|exp:<s>|latency\n"
+                    "         Bring slots online progressively.\n"));
+  fprintf (stdout, (" --resource <name>=<n>\n"
+                    "         Define a resource with <n> units.\n"));
+  fprintf (stdout, (" --demand <name>=<k>[:<pattern>]\n"
+                    "         Jobs (matching <pattern>) need <k> units"
+                    " of <name>.\n"));
+  fprintf (stdout, (" --fair-share\n"
+                    "         Share slots fairly between job submitters.\n"));
+  fprintf (stdout, (" --share <name>=<weight>[:<quota>]\n"
+                    "         Weight (and limit) submitter <name>'s jobs.\n"));
+  fprintf (stdout, (" --lookahead <n>\n"
+                    "         Read up to <n> jobs ahead for fair share"
+                    " (default 64).\n"));
+  fprintf (stdout, (" --token-server <socket>\n"
+                    "         Serve the -j slots as per-host tokens on a"
+                    " Unix socket.\n"));
+  fprintf (stdout, (" --token-socket <socket>\n"
+                    "         Take remote slot tokens from a token"
+                    " server.\n"));
+  fprintf (stdout, (" --sandbox\n"
+                    "         Run local jobs with a read-only root and"
+                    " private /tmp.\n"));
+  fprintf (stdout, (" --sandbox-net\n"
+                    "         As --sandbox, without network access.\n"));
+  fprintf (stdout, (" --scratch <dir>\n"
+                    "         Give each local slot a scratch directory"
+                    " under <dir>.\n"));
+  fprintf (stdout, (" --scratch-size <size>\n"
+                    "         Make scratch directories tmpfs of"
+                    " <size> (eg. 1g).\n"));
+  fprintf (stdout, (" --hostfile <file>\n"
+                    "         Read slot entries and host settings from"
+                    " <file>.\n"));
+  fprintf (stdout, (" --host-cmd <host>=<command>\n"
+                    "         Run <command> instead on <host>.\n"));
+  fprintf (stdout, (" --reprobe <s>\n"
+                    "         Re-size 'auto' hosts every <s> seconds.\n"));
+  fprintf (stdout, (" --auto-mem <size>\n"
+                    "         Memory each job needs on 'auto' hosts.\n"));
+  fprintf (stdout, (" --batch <k>[/<m>]\n"
+                    "         Run up to <k> jobs per remote session, <m> at"
+                    " a time.\n"));
+  fprintf (stdout, (" --transport ssh|ssh-mux|local|<template>\n"
+                    "         How to run commands on remote hosts.\n"));
+  fprintf (stdout, (" --ssh-opt <option>=<value>\n"
+                    "         Pass '-o <option>=<value>' to ssh.\n"));
+  fprintf (stdout, (" --pack   Fill busy hosts first, to use as few as"
+                    " possible.\n"));
+  fprintf (stdout, (" --target-rate <r>\n"
+                    "         Run only enough jobs at once for <r> jobs per"
+                    " second.\n"));
+  fprintf (stdout, (" --idle-hook <command>\n"
+                    "         Run <command> <host> when a host goes idle.\n"));
+  fprintf (stdout, (" --idle-after <s>\n"
+                    "         Seconds before a host counts as idle"
+                    " (default 60).\n"));
+  fprintf (stdout, (" --deadline <time>\n"
+                    "         Aim to finish in <time> seconds (or 'm', 'h'),"
+                    " or by HH:MM.\n"));
+  fprintf (stdout, (" --deadline-hook <command>\n"
+                    "         Run <command> for slots to add when the"
+                    " deadline would be missed.\n"));
+  fprintf (stdout, (" --history <joblog>\n"
+                    "         Estimate job runtimes from a previous"
+                    " joblog.\n"));
+  fprintf (stdout, (" --nice <n>\n"
+                    "         Run local jobs with their niceness raised by"
+                    " <n>.\n"));
+  fprintf (stdout, (" --ioprio idle|best-effort[:<level>]\n"
+                    "         Run local jobs in this I/O scheduling"
+                    " class.\n"));
+  fprintf (stdout, (" --sched batch|idle|other\n"
+                    "         Run local jobs with this CPU scheduling"
+                    " policy.\n"));
+  fprintf (stdout, (" --class <name>=<setting>,...\n"
+                    "         Priorities for jobs tagged 'class=<name>',"
+                    " eg. 'bulk=nice=19'.\n"));
+  fprintf (stdout, (" --self-profile\n"
+                    "         Report the time spent in each phase of"
+                    " dispatching at exit.\n"));
+  fprintf (stdout, (" --prewarm Connect to remote hosts ahead of their"
+                    " next job.\n"));
+  fprintf (stdout, (" --joblog <file>\n"
+                    "         Append a record of each finished job to"
+                    " <file>.\n"));
+  fprintf (stdout, (" --commit-file <file>\n"
+                    "         Keep the input low-watermark in <file>.\n"));
+  fprintf (stdout, (" --zygote\n"
+                    "         Start the command once per slot, and have it"
+                    " fork per job.\n"));
+  fprintf (stdout, (" --spawner\n"
+                    "         Fork jobs from a small helper process.\n"));
+  fprintf (stdout, (" --jobserver\n"
+                    "         Act as a GNU make jobserver for children.\n"));
+  fprintf (stdout, (" --no-jobserver\n"
+                    "         Ignore any jobserver in MAKEFLAGS.\n"));
+  fprintf (stdout, (" --job-tags\n"
+                    "         Input lines are prefixed with "
+                    "'key=value,...<TAB>'.\n"));
+}
+
+void bad_arg (char *arg)
+{
+  fprintf (stderr, "Bad argument: '%s'\n", arg);
+  help ();
+  exit (2);
+}
+
+void missing_arg(char *arg)
+{
+  fprintf (stderr, "Missing parameter to argument: '%s'\n", arg);
+  help ();
+  exit (2);
+}
+
+/* Match long option '--NAME=VALUE' or '--NAME VALUE' at argv[*i],
+   returning VALUE, or NULL if argv[*i] is not option NAME. */
+const char *long_arg (int argc, char *argv[], int *i, const char *name)
+{
+  const char *opt = argv[*i];
+  size_t len = strlen (name);
+  if (opt[0] != '-' || opt[1] != '-' || strncmp (&opt[2], name, len))
+    return NULL;
+  if (opt[2 + len] == '=')
+    return &opt[3 + len];
+  if (opt[2 + len] != '\0')
+    return NULL;
+  if (*i + 1 >= argc)
+    missing_arg (argv[*i]);
+  return argv[++*i];
+}
+
+/* Parse command-line arguments */
+void parse_args(int argc, char *argv[], int *first_arg_p)
+{
+  int i, k;
+  const char *value;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if ((value = long_arg (argc, argv, &i, "max-start-rate")))
+        parse_rate (value, &start_bucket);
+      else if ((value = long_arg (argc, argv, &i, "host-start-rate")))
+        parse_rate (value, &host_start_limit);
+      else if ((value = long_arg (argc, argv, &i, "max-connecting")))
+        {
+          char *end;
+          long n = strtol (value, &end, 10);
+          if (end == value || *end || n < 0 || n > INT_MAX)
+            {
+              fprintf (stderr, "Bad max-connecting: '%s'\n", value);
+              exit (2);
+            }
+          max_connecting = n;
+        }
+      else if ((value = long_arg (argc, argv, &i, "connect-time")))
+        {
+          char *end;
+          connect_time = strtod (value, &end);
+          if (end == value || *end || !(connect_time >= 0))
+            {
+              fprintf (stderr, "Bad connect-time: '%s'\n", value);
+              exit (2);
+            }
+        }
+      else if ((value = long_arg (argc, argv, &i, "ramp-up")))
+        parse_ramp (value);
+      else if ((value = long_arg (argc, argv, &i, "resource")))
+        parse_resource (value);
+      else if ((value = long_arg (argc, argv, &i, "demand")))
+        {
+          demand_args = realloc (demand_args,
+                                 sizeof (*demand_args) * (++n_demand_args));
+          demand_args[n_demand_args - 1] = value;
+        }
+      else if (!strcmp (argv[i], "--job-tags"))
+        job_tags = 1;
+      else if ((value = long_arg (argc, argv, &i, "share")))
+        parse_share (value);
+      else if (!strcmp (argv[i], "--fair-share"))
+        fair_share = 1;
+      else if ((value = long_arg (argc, argv, &i, "lookahead")))
+        {
+          char *end;
+          long n = strtol (value, &end, 10);
+          if (end == value || *end || n < 1 || n > INT_MAX)
+            {
+              fprintf (stderr, "Bad lookahead: '%s'\n", value);
+              exit (2);
+            }
+          lookahead = n;
+        }
+      else if ((value = long_arg (argc, argv, &i, "token-server")))
+        token_server_path = value;
+      else if ((value = long_arg (argc, argv, &i, "token-socket")))
+        token_socket_path = value;
+      else if ((value = long_arg (argc, argv, &i, "scratch")))
+        scratch_base = value;
+      else if ((value = long_arg (argc, argv, &i, "scratch-size")))
+        scratch_size = value;
+      else if (!strcmp (argv[i], "--sandbox"))
+        sandbox = 1;
+      else if (!strcmp (argv[i], "--sandbox-net"))
+        sandbox = sandbox_net = 1;
+      else if ((value = long_arg (argc, argv, &i, "hostfile")))
+        hostfile = value;
+      else if ((value = long_arg (argc, argv, &i, "host-cmd")))
+        parse_host_cmd (value);
+      else if ((value = long_arg (argc, argv, &i, "reprobe")))
+        reprobe_interval = atof (value);
+      else if ((value = long_arg (argc, argv, &i, "auto-mem")))
+        auto_mem = parse_kilobytes (value);
+      else if ((value = long_arg (argc, argv, &i, "batch")))
+        parse_batch (value);
+      else if ((value = long_arg (argc, argv, &i, "transport")))
+        default_transport = value;
+      else if ((value = long_arg (argc, argv, &i, "ssh-opt")))
+        add_host_option ("*", "ssh-opt", value);
+      else if (!strcmp (argv[i], "--pack"))
+        pack = 1;
+      else if ((value = long_arg (argc, argv, &i, "target-rate")))
+        pack = 1, target_rate = atof (value);
+      else if ((value = long_arg (argc, argv, &i, "idle-hook")))
+        idle_hook = value;
+      else if ((value = long_arg (argc, argv, &i, "idle-after")))
+        idle_after = atof (value);
+      else if ((value = long_arg (argc, argv, &i, "deadline")))
+        pack = 1, parse_deadline (value);
+      else if ((value = long_arg (argc, argv, &i, "deadline-hook")))
+        deadline_hook = value;
+      else if ((value = long_arg (argc, argv, &i, "history")))
+        read_history (value);
+      else if ((value = long_arg (argc, argv, &i, "nice")))
+        parse_priority (sched_class (NULL, 0), "nice", value);
+      else if ((value = long_arg (argc, argv, &i, "ioprio")))
+        parse_priority (sched_class (NULL, 0), "ioprio", value);
+      else if ((value = long_arg (argc, argv, &i, "sched")))
+        parse_priority (sched_class (NULL, 0), "sched", value);
+      else if ((value = long_arg (argc, argv, &i, "class")))
+        parse_sched_class (value);
+      else if (!strcmp (argv[i], "--self-profile"))
+        self_profile = 1;
+      else if (!strcmp (argv[i], "--prewarm"))
+        prewarm = 1;
+      else if ((value = long_arg (argc, argv, &i, "joblog")))
+        {
+          joblog = fopen (value, "a");
+          if (!joblog)
+            {
+              fprintf (stderr, "Cannot open job log '%s'\n", value);
+              exit (2);
+            }
+        }
+      else if ((value = long_arg (argc, argv, &i, "commit-file")))
+        commit_file = value;
+      else if (!strcmp (argv[i], "--zygote"))
+        use_zygote = 1;
+      else if (!strcmp (argv[i], "--spawner"))
+        use_spawner = 1;
+      else if (!strcmp (argv[i], "--jobserver"))
+        jobserver_server = 1;
+      else if (!strcmp (argv[i], "--no-jobserver"))
+        use_jobserver = 0;
+      else if (argv[i][1] == 'j')
+        {
+          if (argv[i][2])
+            /* '-j<string>' */
+            slots_string = &argv[i][2];
+          else if (i + 1 < argc)
+            /* '-j' '<string>' */
+            slots_string = argv[++i];
+          else
+            missing_arg (argv[i]);
+          slots_from_env = 0;
+        }
+      else if (argv[i][1] == 'k' && !argv[i][2])
+        continue_on_error = 1;
+      else if (argv[i][1] == 'v' && !argv[i][2])
+        verbose = 1;
+      else if (argv[i][1] == 'n' && !argv[i][2])
+        skip_slot_test = 1;
+      else if (argv[i][1] == 't')
+        {
+          const char *trace_name = "-";
+          if (argv[i][2])
+            /* '-t<filename>' */
+            trace_name = &argv[i][2];
+          else if (i + 1 < argc)
+            /* '-t <filename>' */
+            trace_name = argv[++i];
+          else
+            /* '-t' */
+            missing_arg (argv[i]);
+          if (trace_name[0] == '-' && trace_name[1] == '\0')
+            trace = stderr;
+          else
+            trace = fopen (trace_name, "w");
+          if (trace_name && !trace)
+            {
+              fprintf (stderr, "Cannot open trace file '%s'\n", trace_name);
+              exit (0);
+            }
+        }
+      else if (argv[i][1] == 'f')
+        {
+          const char *in_arguments_name = "-";
+          if (argv[i][2])
+            in_arguments_name = &argv[i][2];
+          else if (i + 1 < argc)
+            in_arguments_name = argv[++i];
+          else
+            missing_arg (argv[i]);
+          if (in_arguments_name[0] == '-' && in_arguments_name[1] == '\0')
+            in_arguments = stdin;
+          else
+            in_arguments = fopen(in_arguments_name, "r");
+          if (!in_arguments)
+            {
+              fprintf (stderr, "Cannot open input file '%s'\n",
+                       in_arguments_name);
+              exit (0);
+            }
+        }
+      else if (argv[i][1] == 'h' || (argv[i][1] == '-' && argv[i][2] == 'h'))
+        {
+          help();
+          exit (0);
+        }
+      else if (!strcmp(argv[i], "sync"))
+        {
+          sync_working_dirs = 1;
+        }
+      else
+        bad_arg (argv[i]);
+    }
+  for (k = 0; k < n_demand_args; k++)
+    parse_demand (demand_args[k]);
+  *first_arg_p = i;
+}
+
+/* The remote shell script for the batch of jobs from JOB in SLOT:
+   batch_lanes subshells run in parallel, each running its share of
+   the jobs in turn and printing each one's status line. */
+char *batch_script (int slot, Job *job)
+{
+  char **args = slots[slot].args;
+  size_t size = 16, cmd_len = 0;
+  int lane, k, a;
+  Job *j;
+  char *script;
+  for (a = slots[slot].cmd_arg; a < slots[slot].n_args; a++)
+    cmd_len += strlen (args[a]) + 1;
+  for (j = job; j; j = j->next)
+    size += cmd_len + 2 * strlen (j->arg) + 64;
+  script = malloc (size + 8 * batch_lanes);
+  script[0] = '\0';
+  for (lane = 0; lane < batch_lanes; lane++)
+    {
+      int empty = 1;
+      for (j = job, k = 0; j; j = j->next, k++)
+        if (k % batch_lanes == lane)
+          {
+            if (empty)
+              strcat (script, "( ");
+            empty = 0;
+            for (a = slots[slot].cmd_arg; a < slots[slot].n_args; a++)
+              {
+                strcat (script, args[a]);
+                strcat (script, " ");
+              }
+            strcat (script, escape_str (j->arg));
+            sprintf (script + strlen (script),
+                     " </dev/null; echo %s %ld $?; ", BATCH_MARKER, j->seq);
+          }
+      if (!empty)
+        strcat (script, ") & ");
+    }
+  strcat (script, "wait");
+  return script;
+}
+
+/* Apply the priorities of class C, falling back to the settings for
+   every job, to this process, about to become a job. */
+void sched_apply (int c)
+{
+  SchedClass *sc = &sched_classes[c], *all = &sched_classes[0];
+  int inc = sc->nice != INT_MIN ? sc->nice : all->nice;
+  int ioprio = sc->ioprio != -1 ? sc->ioprio : all->ioprio;
+  int policy = sc->policy != SCHED_UNSET ? sc->policy : all->policy;
+  errno = 0;
+  if (inc != INT_MIN && nice (inc) == -1 && errno)
+    perror ("forkargs: nice");
+#if defined(__linux__)
+  if (policy != SCHED_UNSET)
+    {
+      struct sched_param param = { 0 };
+      if (sched_setscheduler (0, (policy == SCHED_AS_BATCH ? SCHED_BATCH
+                                  : policy == SCHED_AS_IDLE ? SCHED_IDLE
+                                  : SCHED_OTHER), &param) == -1)
+        perror ("forkargs: sched_setscheduler");
+    }
+  /* IOPRIO_WHO_PROCESS is 1. */
+  if (ioprio != -1 && syscall (SYS_ioprio_set, 1, 0, ioprio) == -1)
+    perror ("forkargs: ioprio_set");
+#else
+  if (policy != SCHED_UNSET || ioprio != -1)
+    fprintf (stderr, "forkargs: --ioprio and --sched need Linux\n");
+#endif
+}
+
+/* Child side of spawning a job: set up and exec the command for
+   input line STR in SLOT. Does not return. */
+void exec_job (int slot, Job *job, const char *prog)
+{
+  int i;
+  int status;
+  int n = slots[slot].n_args;
+  if (job)
+    prof_child_stamp (slot, 0);
+  /* Construct exec parameters. A NULL JOB starts the command with no
+     input argument (a zygote). */
+  if (!job)
+    ;
+  else if (job->next)
+    {
+      /* A batch replaces the command with a script running them all. */
+      slots[slot].args[slots[slot].cmd_arg] = batch_script (slot, job);
+      n = slots[slot].cmd_arg + 1;
+    }
+  else if (slots[slot].remote_slot)
+    slots[slot].args[n++] = escape_str (job->arg);
+  else
+    slots[slot].args[n++] = job->arg;
+  if (slots[slot].remote_slot && hosts[slots[slot].host].join_cmd)
+    {
+      int r = slots[slot].remote_arg;
+      slots[slot].args[r] = join_words (slots[slot].args + r, n - r);
+      n = r + 1;
+    }
+  slots[slot].args[n] = NULL;
+
+  if (trace)
+    {
+      fprintf (trace, "%s: exec ", prog);
+      for (i = 0; i < n; i++)
+        fprintf (trace, "'%s' ", slots[slot].args[i]);
+      fprintf (trace, "\n");
+    }
+
+  if (verbose)
+    {
+      fprintf (stderr, "forkargs: (%s) ",
+               (slots[slot].hostname ? slots[slot].hostname
+                : "localhost"));
+      for (i = 0; i < n; i++)
+        if (strstr(slots[slot].args[i], " ") == NULL)
+          /* No real need to print anything fancy */
+          fprintf (stderr, "%s ", slots[slot].args[i]);
+        else if (strstr(slots[slot].args[i], "'") == NULL)
+          /* Print with '' if that'll look okay */
+          fprintf (stderr, "'%s' ", slots[slot].args[i]);
+        else
+          {
+            /* Escape the whole thing. Looks ugly, but should
+               be rare. */
+            char *e = escape_str (slots[slot].args[i]);
+            fprintf (stderr, "%s ", e);
+            free (e);
+          }
+      fprintf (stderr, "\n");
+    }
+
+  /* Close parent's stdin */
+  close(STDIN_FILENO);
+  open("/dev/null", O_RDONLY);
+  signal (SIGPIPE, SIG_DFL);
+
+  /* Priorities are set here for local jobs; a zygote passes its own
+     on to the jobs it forks. */
+  if (n_sched_classes && !slots[slot].remote_slot)
+    sched_apply (job ? job->sched_class : 0);
+
+#if defined(__linux__)
+  if (slots[slot].sandbox_pid > 0)
+    sandbox_enter (slot);
+#endif
+
+  if (slots[slot].scratch_root)
+    {
+      char *scratch = malloc (strlen (slots[slot].scratch_root) + 16);
+      sprintf (scratch, "%s/scratch", slots[slot].scratch_root);
+      setenv ("FORKARGS_SCRATCH", scratch, 1);
+      setenv ("TMPDIR", scratch, 1);
+    }
+
+  /* Change working directory, but only if it's a local slot! */
+  if (slots[slot].working_dir != NULL && slots[slot].hostname == NULL)
+    {
+      if (trace)
+        fprintf (trace, "forkargs: chdir to '%s'\n",
+                 slots[slot].working_dir);
+      if (chdir(slots[slot].working_dir) == -1)
+        {
+          perror(slots[slot].args[0]);
+          _exit(1);
+        }
+    }
+  if (job)
+    prof_child_stamp (slot, 1);
+  /* A child must not run the dispatcher's atexit handlers, which
+     hand back jobserver tokens and kill sandboxes and zygotes. */
+  status = execvp(slots[slot].args[0], slots[slot].args);
+  if (status == -1)
+    {
+      perror(slots[slot].args[0]);
+      _exit(1);
+    }
+  else
+    {
+      _exit(0);
+    }
+}
+
+
+/* Append a record of JOB, which ran in SLOT, to the job log. */
+void joblog_write (int slot, Job *job, int status, double runtime)
+{
+  fprintf (joblog, "%ld\t%ld\t%lu\t%s\t%.3f\t%d\t%s\n",
+           job->seq, job->offset, (unsigned long) job->length,
+           slots[slot].hostname ? slots[slot].hostname : "localhost",
+           runtime,
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+           job->arg);
+  fflush (joblog);
+}
+
+/* Update the commit file with the low watermark: the last input line
+   up to which every job has completed successfully, and the offset of
+   the first input byte not yet fully processed. PENDING is the job
+   read but not yet started, if any. A failed job holds the watermark
+   back for good, so that nothing after it is acknowledged. */
+void commit_update (Job *pending)
+{
+  long seq = input_seq, offset = input_offset;
+  Job *job;
+  int i;
+  FILE *f;
+  char *tmp;
+  if (pending)
+    {
+      seq = pending->seq - 1;
+      offset = pending->offset;
+    }
+  /* A batch's jobs need not be in input order. */
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].cpid != -1)
+      for (job = slots[i].job; job; job = job->next)
+        if (job->seq <= seq)
+          {
+            seq = job->seq - 1;
+            offset = job->offset;
+          }
+  for (job = held_jobs; job; job = job->next)
+    if (job->seq <= seq)
+      {
+        seq = job->seq - 1;
+        offset = job->offset;
+      }
+  if (commit_block_seq && commit_block_seq <= seq)
+    {
+      seq = commit_block_seq - 1;
+      offset = commit_block_offset;
+    }
+  if (seq == commit_seq)
+    return;
+  commit_seq = seq;
+
+  /* Write, sync and rename, so readers see the old or new watermark
+     only, even after a crash. */
+  tmp = malloc (strlen (commit_file) + 8);
+  sprintf (tmp, "%s.tmp", commit_file);
+  f = fopen (tmp, "w");
+  if (!f || fprintf (f, "%ld %ld\n", seq, offset) < 0 || fflush (f) != 0
+      || fsync (fileno (f)) == -1 || fclose (f) != 0
+      || rename (tmp, commit_file) == -1)
+    {
+      fprintf (stderr, "forkargs: cannot write commit file '%s': %s\n",
+               commit_file, strerror (errno));
+      exit (1);
+    }
+  free (tmp);
+}
+
+/* Hold the commit watermark back at JOB, which failed or never ran. */
+void commit_block (Job *job)
+{
+  if (!commit_block_seq || job->seq < commit_block_seq)
+    {
+      commit_block_seq = job->seq;
+      commit_block_offset = job->offset;
+    }
+}
+
+/* Give up on JOB without running it. */
+void drop_job (Job *job)
+{
+  stats.dropped++;
+  commit_block (job);
+  free_job (job);
+}
+
+/* Is ERR a transient reason for a spawn to fail? */
+int spawn_error_transient (int err)
+{
+  return err == EAGAIN || err == ENOMEM || err == EINTR;
+}
+
+/* A spawn failed at time T: back off, and cap concurrency at the
+   number of jobs that did manage to start. */
+void spawn_failed (double t, const char *prog)
+{
+  spawn_backoff = spawn_backoff ? spawn_backoff * 2 : SPAWN_BACKOFF_MIN;
+  if (spawn_backoff > SPAWN_BACKOFF_MAX)
+    spawn_backoff = SPAWN_BACKOFF_MAX;
+  spawn_retry_at = t + spawn_backoff;
+  spawn_limit = n_active > 1 ? n_active : 1;
+  if (!stats.min_spawn_limit || spawn_limit < stats.min_spawn_limit)
+    stats.min_spawn_limit = spawn_limit;
+  stats.spawn_failures++;
+  if (verbose || trace)
+    fprintf (trace ? trace : stderr,
+             "%s: cannot fork (%s), retrying in %.2fs with at most %d jobs\n",
+             prog, strerror (errno), spawn_backoff, spawn_limit);
+}
+
+/* A job completed: let concurrency grow back. */
+void spawn_limit_grow (void)
+{
+  if (spawn_limit && ++spawn_limit >= n_slots)
+    spawn_limit = 0;
+}
+
+/* Account for JOB, run in SLOT, finishing with STATUS. */
+void job_done (int slot, Job *job, int status)
+{
+  if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    {
+      if (verbose)
+        fprintf (stderr, "forkargs: (%s) exited with return code %d\n",
+                 (slots[slot].hostname ? slots[slot].hostname : "localhost"),
+                 WEXITSTATUS(status));
+      error_encountered = 1;
+    }
+  else if (WIFSIGNALED(status))
+    {
+      if (verbose)
+        fprintf (stderr, "forkargs: (%s) killed by signal %d\n",
+                 (slots[slot].hostname ? slots[slot].hostname : "localhost"),
+                 WTERMSIG(status));
+      error_encountered = 1;
+    }
+  else if (WIFEXITED(status))
+    {
+      double runtime = now () - job->started;
+      hosts[slots[slot].host].warm = 1;
+      ramp_job_done (runtime);
+      /* The first job of this run replaces any estimate from
+         --history, rather than being averaged into it. */
+      if (runtime_avg && !runtime_from_history)
+        runtime_avg = 0.9 * runtime_avg + 0.1 * runtime;
+      else
+        runtime_avg = runtime;
+      runtime_from_history = 0;
+    }
+
+  if (joblog)
+    {
+      double t0 = prof_begin ();
+      joblog_write (slot, job, status, now () - job->started);
+      prof_end (PROF_RECORDS, t0);
+    }
+  if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+    commit_block (job);
+
+  stats.finished++;
+  if (fair_share)
+    {
+      submitters[job->submitter].running--;
+      submitters[job->submitter].finished++;
+      submitters[job->submitter].busy += now () - job->started;
+    }
+  claim_resources (job, -1);
+  free_job (job);
+}
+
+/* Read what is available on FD into LB. Returns 0 on EOF or error. */
+int linebuf_fill (int fd, LineBuf *lb)
+{
+  ssize_t n = read (fd, lb->buf + lb->len, sizeof (lb->buf) - 1 - lb->len);
+  if (n == -1 && (errno == EINTR || errno == EAGAIN))
+    return 1;
+  if (n <= 0)
+    return 0;
+  lb->len += n;
+  lb->buf[lb->len] = '\0';
+  return 1;
+}
+
+/* Take the next complete line from LB into LINE (of size SIZE),
+   without its newline. Returns 0 if there is no complete line. */
+int linebuf_line (LineBuf *lb, char *line, size_t size)
+{
+  char *nl = memchr (lb->buf, '\n', lb->len);
+  size_t n;
+  if (!nl)
+    {
+      if (lb->len < sizeof (lb->buf) - 1)
+        return 0;
+      nl = lb->buf + lb->len - 1;   /* overlong: split it */
+    }
+  n = nl - lb->buf;
+  if (n >= size)
+    n = size - 1;
+  memcpy (line, lb->buf, n);
+  line[n] = '\0';
+  lb->len -= nl + 1 - lb->buf;
+  memmove (lb->buf, nl + 1, lb->len);
+  lb->buf[lb->len] = '\0';
+  return 1;
+}
+
+/* The job numbered SEQ in SLOT's batch reported exit code RC. */
+void batch_item_done (int slot, long seq, int rc)
+{
+  Job **j;
+  for (j = &slots[slot].job; *j; j = &(*j)->next)
+    if ((*j)->seq == seq)
+      {
+        Job *job = *j, *next;
+        *j = job->next;
+        /* The next job in the same lane starts now. */
+        for (next = job->next; next; next = next->next)
+          if (next->lane == job->lane)
             {
-              const char *c2 = c;
-              char num[BUFSIZ];
-              i = 0;
-              while (*c2 && isdigit(*c2))
-                num[i++ % BUFSIZ] = *c2++;
-              num[i++] = '\0';
-              while (*c2 && isspace(*c2))
-                c2++;
-              if (*c2 && *c2 == '*')
-                {
-                  num_slots = atol(num);
-                  c = c2+1;
-                  while (*c && isspace(*c))
-                    c++;
-                }
-              else if (!*c2 || *c2 == ',')
-                {
-                  num_slots = atol (num);
-                  c = c2;       /* don't skip the ',' if there is one. */
-                }
+              next->started = now ();
+              break;
             }
+        /* The remote shell reports signals as 128 + signal number,
+           so this is always an exit status. */
+        job_done (slot, job, (rc & 0xff) << 8);
+        return;
+      }
+}
+
+/* Find BATCH_MARKER in the LEN bytes at BUF, or return NULL. */
+char *batch_marker (char *buf, size_t len)
+{
+  size_t i, n = strlen (BATCH_MARKER);
+  for (i = 0; i + n <= len; i++)
+    if (buf[i] == BATCH_MARKER[0] && !memcmp (buf + i, BATCH_MARKER, n))
+      return buf + i;
+  return NULL;
+}
+
+/* Read what SLOT's batch session has written: pass its output on to
+   our stdout byte for byte, and account for each job as its status
+   line arrives. Only the status lines are parsed; a tail that might be
+   the start of one is kept back until more arrives. Returns 1 if
+   something was read, -1 if nothing was ready, or 0 at the end of the
+   output, when everything kept back is written too. */
+int batch_read (int slot)
+{
+  LineBuf *lb = slots[slot].batch_buf;
+  size_t n = strlen (BATCH_MARKER), keep;
+  ssize_t got = read (slots[slot].batch_fd, lb->buf + lb->len,
+                      sizeof (lb->buf) - 1 - lb->len);
+  if (got == -1 && (errno == EINTR || errno == EAGAIN))
+    return -1;
+  if (got > 0)
+    lb->len += got;
+  for (;;)
+    {
+      char *marker = batch_marker (lb->buf, lb->len), *nl = NULL;
+      long seq;
+      int rc;
+      if (marker)
+        nl = memchr (marker, '\n', lb->len - (marker - lb->buf));
+      if (!nl)
+        break;
+      /* Anything before it is the end of a job's unterminated output. */
+      fwrite (lb->buf, 1, marker - lb->buf, stdout);
+      *nl = '\0';
+      if (sscanf (marker + n, "%ld %d", &seq, &rc) == 2)
+        batch_item_done (slot, seq, rc);
+      lb->len -= nl + 1 - lb->buf;
+      memmove (lb->buf, nl + 1, lb->len);
+    }
+  /* Keep back an incomplete status line, or a tail that could begin
+     one. */
+  keep = 0;
+  if (got > 0)
+    {
+      char *marker = batch_marker (lb->buf, lb->len);
+      if (marker)
+        keep = lb->len - (marker - lb->buf);
+      else
+        for (keep = n - 1 < lb->len ? n - 1 : lb->len; keep > 0; keep--)
+          if (!memcmp (lb->buf + lb->len - keep, BATCH_MARKER, keep))
+            break;
+      if (keep >= sizeof (lb->buf) - 1)
+        keep = 0;               /* not a status line after all */
+    }
+  fwrite (lb->buf, 1, lb->len - keep, stdout);
+  memmove (lb->buf, lb->buf + lb->len - keep, keep);
+  lb->len = keep;
+  fflush (stdout);
+  return got > 0;
+}
+
+/* Account for termination of child CPID with STATUS. */
+void job_finished (pid_t cpid, int status, const char *prog)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].cpid == cpid)
+      break;
+  if (i == n_slots)
+    {
+      fprintf (stderr, "%s: cannot find child %d in slot table\n",
+               prog, cpid);
+      exit(1);
+    }
+
+  if (trace)
+    fprintf (trace, "%s: child %d terminated with status %d (rc %d)\n",
+             prog, cpid, status, WEXITSTATUS(status));
+
+  if (slots[i].batch_fd != -1)
+    {
+      /* Collect the statuses still to be read: the session wrote them
+         before it exited, so they are in the pipe, and reading stays
+         non-blocking in case something it left behind holds the pipe
+         open. Jobs without a status were lost with the session. */
+      while (batch_read (i) > 0)
+        ;
+      fwrite (slots[i].batch_buf->buf, 1, slots[i].batch_buf->len, stdout);
+      fflush (stdout);
+      slots[i].batch_buf->len = 0;
+      close (slots[i].batch_fd);
+      slots[i].batch_fd = -1;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        status = 255 << 8;
+    }
+  while (slots[i].job)
+    {
+      Job *job = slots[i].job;
+      slots[i].job = job->next;
+      job_done (i, job, status);
+    }
+
+  if (child_stamps && i < n_child_stamps && child_stamps[2 * i + 1])
+    {
+      prof_add (PROF_CHILD_START, child_stamps[2 * i] - slots[i].spawn_at);
+      prof_add (PROF_CHILD_SETUP,
+                child_stamps[2 * i + 1] - child_stamps[2 * i]);
+      child_stamps[2 * i] = child_stamps[2 * i + 1] = 0;
+    }
+
+  slots[i].cpid = -1;
+  if (--hosts[slots[i].host].running == 0)
+    hosts[slots[i].host].idle_since = now ();
+  spawn_limit_grow ();
+  token_release (i);
+  scratch_recycle (i);
+  n_active--;
+  if (trace)
+    {
+      fprintf (trace, "Removed process from slot table entry %d\n", i);
+      print_slots(trace);
+    }
+}
+
+/* Read or write exactly LEN bytes, returning 0 on EOF or error. */
+int read_full (int fd, void *buf, size_t len)
+{
+  char *c = buf;
+  while (len > 0)
+    {
+      ssize_t n = read (fd, c, len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 0;
+      c += n;
+      len -= n;
+    }
+  return 1;
+}
+
+int write_full (int fd, const void *buf, size_t len)
+{
+  const char *c = buf;
+  while (len > 0)
+    {
+      ssize_t n = write (fd, c, len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 0;
+      c += n;
+      len -= n;
+    }
+  return 1;
+}
+
+/* Send string STR (or NULL) to the spawner. */
+int spawner_send_str (const char *str)
+{
+  size_t len = str ? strlen (str) : (size_t) -1;
+  return write_full (spawner_fd, &len, sizeof (len))
+    && (!str || write_full (spawner_fd, str, len));
+}
+
+/* Read a string sent by spawner_send_str() from FD. */
+char *spawner_recv_str (int fd)
+{
+  size_t len;
+  char *str;
+  if (!read_full (fd, &len, sizeof (len)))
+    _exit (1);
+  if (len == (size_t) -1)
+    return NULL;
+  str = malloc (len + 1);
+  if (!read_full (fd, str, len))
+    _exit (1);
+  str[len] = '\0';
+  return str;
+}
+
+/* Tell the spawner about SLOT, added since it split off, with all that
+   exec_job() needs of it. */
+void spawner_send_slot (int slot)
+{
+  SpawnRequest req;
+  SpawnSlot desc;
+  int i, ok;
+  req.type = SPAWN_SLOT;
+  req.slot = slot;
+  req.sched_class = 0;
+  req.len = 0;
+  desc.host = slots[slot].host;
+  desc.join_cmd = hosts[slots[slot].host].join_cmd;
+  desc.remote_slot = slots[slot].remote_slot;
+  desc.n_args = slots[slot].n_args;
+  desc.cmd_arg = slots[slot].cmd_arg;
+  desc.remote_arg = slots[slot].remote_arg;
+  desc.sandbox_pid = slots[slot].sandbox_pid;
+  ok = write_full (spawner_fd, &req, sizeof (req))
+    && write_full (spawner_fd, &desc, sizeof (desc))
+    && spawner_send_str (slots[slot].hostname)
+    && spawner_send_str (slots[slot].working_dir)
+    && spawner_send_str (slots[slot].scratch_root);
+  for (i = 0; ok && i < desc.n_args; i++)
+    ok = spawner_send_str (slots[slot].args[i]);
+  if (!ok)
+    {
+      fprintf (stderr, "forkargs: lost spawner process\n");
+      exit (1);
+    }
+}
+
+/* Spawner side of spawner_send_slot(): add the slot described on FD. */
+void spawner_recv_slot (int fd, int slot)
+{
+  SpawnSlot desc;
+  Slot *s;
+  int i;
+  if (!read_full (fd, &desc, sizeof (desc)))
+    _exit (1);
+  if (slot >= n_slots)
+    {
+      slots = realloc (slots, sizeof (*slots) * (slot + 1));
+      memset (slots + n_slots, 0, sizeof (*slots) * (slot + 1 - n_slots));
+      n_slots = slot + 1;
+    }
+  if (desc.host >= n_hosts)
+    {
+      hosts = realloc (hosts, sizeof (*hosts) * (desc.host + 1));
+      memset (hosts + n_hosts, 0, sizeof (*hosts) * (desc.host + 1 - n_hosts));
+      n_hosts = desc.host + 1;
+    }
+  hosts[desc.host].join_cmd = desc.join_cmd;
+  s = &slots[slot];
+  s->host = desc.host;
+  s->remote_slot = desc.remote_slot;
+  s->n_args = desc.n_args;
+  s->cmd_arg = desc.cmd_arg;
+  s->remote_arg = desc.remote_arg;
+  s->sandbox_pid = desc.sandbox_pid;
+  s->hostname = spawner_recv_str (fd);
+  s->working_dir = spawner_recv_str (fd);
+  s->scratch_root = spawner_recv_str (fd);
+  s->args = calloc (desc.n_args + 2, sizeof (*s->args));
+  for (i = 0; i < desc.n_args; i++)
+    s->args[i] = spawner_recv_str (fd);
+}
+
+/* The spawner process: fork and exec jobs as requested on FD, and
+   report their pids and exit statuses back. Slots added later are
+   described to it by spawner_send_slot() before their first job. */
+void spawner_main (int fd, const char *prog)
+{
+  SpawnRequest req;
+  SpawnReply reply;
+  char buf[64];
+  Job job;
+
+  signal (SIGINT, SIG_IGN);
+  close (sigchld_pipe[0]);
+  close (sigchld_pipe[1]);
+  if (pipe (sigchld_pipe) == -1)
+    _exit (1);
+  fcntl (sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl (sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+  for (;;)
+    {
+      fd_set fds;
+      int status;
+      pid_t pid;
+      while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+        {
+          reply.type = EXITED;
+          reply.pid = pid;
+          reply.status = status;
+          if (!write_full (fd, &reply, sizeof (reply)))
+            _exit (1);
+        }
+      FD_ZERO (&fds);
+      FD_SET (fd, &fds);
+      FD_SET (sigchld_pipe[0], &fds);
+      if (select ((fd > sigchld_pipe[0] ? fd : sigchld_pipe[0]) + 1,
+                  &fds, NULL, NULL, NULL) <= 0)
+        continue;
+      while (read (sigchld_pipe[0], buf, sizeof (buf)) > 0)
+        ;
+      if (!FD_ISSET (fd, &fds))
+        continue;
+
+      if (!read_full (fd, &req, sizeof (req)))
+        {
+          /* Dispatcher finished; it has no jobs left to hear about. */
+          _exit (0);
+        }
+      if (req.type == SPAWN_SLOT)
+        {
+          spawner_recv_slot (fd, req.slot);
+          continue;
+        }
+      memset (&job, 0, sizeof (job));
+      job.arg = malloc (req.len + 1);
+      if (!read_full (fd, job.arg, req.len))
+        _exit (1);
+      job.arg[req.len] = '\0';
+      job.sched_class = req.sched_class;
+
+      pid = fork ();
+      if (pid == 0)
+        {
+          signal (SIGINT, SIG_DFL);
+          signal (SIGCHLD, SIG_DFL);
+          close (fd);
+          exec_job (req.slot, &job, prog);
+        }
+      reply.type = SPAWNED;
+      reply.pid = pid;
+      reply.status = pid == -1 ? errno : 0;
+      free (job.arg);
+      if (!write_full (fd, &reply, sizeof (reply)))
+        _exit (1);
+    }
+}
+
+/* Split off the spawner. Call once all slot setup is done, so that
+   the spawner knows everything exec_job() needs. */
+void spawner_start (const char *prog)
+{
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1
+      || (spawner_pid = fork ()) == -1)
+    {
+      perror ("forkargs: spawner");
+      exit (1);
+    }
+  if (spawner_pid == 0)
+    {
+      close (fds[0]);
+      spawner_main (fds[1], prog);
+    }
+  close (fds[1]);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  spawner_fd = fds[0];
+}
+
+/* Read one reply from the spawner. */
+void spawner_read (SpawnReply *reply)
+{
+  if (!read_full (spawner_fd, reply, sizeof (*reply)))
+    {
+      fprintf (stderr, "forkargs: lost spawner process\n");
+      exit (1);
+    }
+}
+
+/* Shell script run on 'auto' hosts to report their capacity, as
+   '<nproc> <quota> <period> <mem> <load>': the processors available,
+   the cgroup CPU quota ('max' or -1 if none) and period, the memory
+   available in kilobytes (0 if unknown) and the 1-minute load. */
+const char probe_script[] =
+  "n=$(nproc 2>/dev/null || getconf _NPROCESSORS_ONLN);"
+  " q='max 100000';"
+  " f=/sys/fs/cgroup/cpu/cpu.cfs_quota_us;"
+  " [ -r $f ] && q=\"$(cat $f) $(cat /sys/fs/cgroup/cpu/cpu.cfs_period_us)\";"
+  " [ -r /sys/fs/cgroup/cpu.max ] && q=$(cat /sys/fs/cgroup/cpu.max);"
+  " m=$(awk '/^MemAvailable:/ { print $2 }' /proc/meminfo 2>/dev/null);"
+  " f=/sys/fs/cgroup/memory.max;"
+  " if [ -r $f ] && [ \"$(cat $f)\" != max ]; then"
+  " c=$(( ($(cat $f) - $(cat /sys/fs/cgroup/memory.current)) / 1024 ));"
+  " [ -z \"$m\" ] || [ $c -lt $m ] && m=$c; fi;"
+  " l=$(cut -d' ' -f1 /proc/loadavg 2>/dev/null);"
+  " echo \"$n $q ${m:-0} ${l:-0}\"";
+
+/* Start the capability probe for host H, reading its output through
+   hosts[h].probe_fd. Returns 0 on failure. */
+int probe_start (int h)
+{
+  int fds[2];
+  char **args = host_command (h, probe_script);
+  if (pipe (fds) == -1)
+    return 0;
+  hosts[h].probe_pid = fork ();
+  if (hosts[h].probe_pid == -1)
+    {
+      hosts[h].probe_pid = 0;
+      close (fds[0]);
+      close (fds[1]);
+      return 0;
+    }
+  if (hosts[h].probe_pid == 0)
+    {
+      close (fds[0]);
+      dup2 (fds[1], STDOUT_FILENO);
+      close (fds[1]);
+      close (STDIN_FILENO);
+      open ("/dev/null", O_RDONLY);
+      execvp (args[0], args);
+      _exit (127);
+    }
+  free (args);
+  close (fds[1]);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  hosts[h].probe_fd = fds[0];
+  if (!hosts[h].probe_buf)
+    hosts[h].probe_buf = calloc (1, sizeof (LineBuf));
+  hosts[h].probe_buf->len = 0;
+  return 1;
+}
+
+/* Size host H from the probe report LINE: one slot per processor the
+   cgroup quota allows, less the load not caused by our own jobs, and
+   no more than fit in its free memory if --auto-mem is given. Sets
+   the host's slot limit, and returns its processor count, or -1 if
+   LINE is bad. */
+int probe_result (int h, const char *line)
+{
+  char quota[32];
+  long period, mem;
+  double load, cpus;
+  int ncpu, limit, running = 0, i;
+  if (sscanf (line, "%d %31s %ld %ld %lf", &ncpu, quota, &period, &mem,
+              &load) != 5 || ncpu < 1)
+    return -1;
+  cpus = ncpu;
+  if (isdigit (quota[0]) && period > 0 && atof (quota) / period < cpus)
+    cpus = atof (quota) / period;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].host == h && slots[i].cpid != -1)
+      running++;
+  load -= running;
+  if (load < 0)
+    load = 0;
+  limit = (int) (cpus - load + 0.5);
+  if (auto_mem > 0 && mem > 0 && mem / auto_mem + running < limit)
+    limit = mem / auto_mem + running;
+  if (limit > ncpu)
+    limit = ncpu;
+  if (limit < 1)
+    limit = 1;
+  if (verbose || trace)
+    fprintf (trace ? trace : stderr,
+             "forkargs: %s: %d processors, using %d slots\n",
+             hosts[h].hostname ? hosts[h].hostname : "localhost",
+             ncpu, limit);
+  hosts[h].slot_limit = limit;
+  return ncpu;
+}
+
+/* Start checking host H: probe it if it is an 'auto' host, and
+   otherwise make sure it is accessible by running 'true' there. Its
+   slots are not used until the check succeeds. */
+void host_check_start (int h)
+{
+  if (verbose)
+    fprintf (stderr, "forkargs: testing remote slot on '%s'\n",
+             hosts[h].hostname ? hosts[h].hostname : "localhost");
+  hosts[h].checking = 1;
+  if (hosts[h].auto_size)
+    {
+      if (!probe_start (h))
+        perror ("forkargs: probe");
+    }
+  else
+    {
+      char **args = host_command (h, "true");
+      hosts[h].probe_pid = fork ();
+      if (hosts[h].probe_pid == 0)
+        {
+          close (STDIN_FILENO);
+          open ("/dev/null", O_RDONLY);
+          execvp (args[0], args);
+          perror (args[0]);
+          _exit (1);
+        }
+      free (args);
+      if (hosts[h].probe_pid == -1)
+        hosts[h].probe_pid = 0;
+    }
+  if (!hosts[h].probe_pid)
+    {
+      hosts[h].probe_exited = 1;
+      hosts[h].probe_status = 1 << 8;
+    }
+}
+
+/* Start the zygote for local SLOT: the command, without an input
+   argument, with FORKARGS_ZYGOTE_FD naming its end of a socket. */
+void zygote_start (int slot, const char *prog)
+{
+  int fds[2];
+  char num[32];
+  pid_t pid;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1
+      || (pid = fork ()) == -1)
+    {
+      perror ("forkargs: zygote");
+      exit (1);
+    }
+  if (pid == 0)
+    {
+      close (fds[0]);
+      sprintf (num, "%d", fds[1]);
+      setenv ("FORKARGS_ZYGOTE_FD", num, 1);
+      signal (SIGCHLD, SIG_DFL);
+      exec_job (slot, NULL, prog);
+    }
+  close (fds[1]);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  slots[slot].zygote_pid = pid;
+  slots[slot].zygote_fd = fds[0];
+  slots[slot].zygote_ready = 0;
+  slots[slot].zygote_buf = calloc (1, sizeof (LineBuf));
+}
+
+/* Set up slot N, added once the run has started, as the slots at the
+   start were: local slots get their scratch directory, sandbox and
+   zygote, and the spawner is told about it. */
+void slot_added (int n)
+{
+  if (!slots[n].remote_slot)
+    {
+      if (scratch_base)
+        scratch_setup_slot (n);
+#if defined(__linux__)
+      if (sandbox)
+        sandbox_setup_slot (n);
+#endif
+      scratch_recycle (n);
+      if (use_zygote)
+        zygote_start (n, "forkargs");
+    }
+  if (spawner_fd != -1)
+    spawner_send_slot (n);
+}
+
+/* Give 'auto' host H, whose probe found NCPU processors, that many
+   slots, adding copies of its slot at the end of the table. Local
+   slots get their own scratch root, sandbox and zygote, as the first
+   slots had by now. */
+void host_grow (int h, int ncpu)
+{
+  int i, j;
+  for (i = n_slots - 1; slots[i].host != h; i--)
+    ;
+  j = slots[i].host_rank + 1;
+  if (ncpu <= j)
+    return;
+  slots = realloc (slots, sizeof (*slots) * (n_slots + ncpu - j));
+  for (; j < ncpu; j++)
+    {
+      int n = n_slots++;
+      Slot *slot = &slots[n];
+      *slot = slots[i];
+      slot->host_rank = j;
+      slot->cpid = -1;
+      slot->job = NULL;
+      slot->token_held = 0;
+      slot->batch_fd = -1;
+      slot->batch_buf = NULL;
+      slot->warm_pid = 0;
+      slot->warm_fd = -1;
+      slot->warm_wanted = 0;
+      slot->sandbox_pid = 0;
+      slot->scratch_root = NULL;
+      slot->scratch_gen = 0;
+      slot->zygote_pid = 0;
+      slot->zygote_fd = -1;
+      slot->zygote_buf = NULL;
+      slot->zygote_ready = 0;
+      slot_added (n);
+    }
+}
+
+/* Host H's test or probe process has exited: read any probe report,
+   and if this was the host's first check, put its slots to use or
+   mark them faulted. */
+void host_check_done (int h)
+{
+  char line[BUFSIZ];
+  int ncpu = -1, ok, i;
+  int status = hosts[h].probe_status;
+  hosts[h].probe_exited = 0;
+  if (hosts[h].probe_fd != -1)
+    {
+      fcntl (hosts[h].probe_fd, F_SETFL, 0);
+      while (linebuf_fill (hosts[h].probe_fd, hosts[h].probe_buf)
+             && !memchr (hosts[h].probe_buf->buf, '\n',
+                         hosts[h].probe_buf->len))
+        ;
+      if (linebuf_line (hosts[h].probe_buf, line, sizeof (line)))
+        ncpu = probe_result (h, line);
+      close (hosts[h].probe_fd);
+      hosts[h].probe_fd = -1;
+    }
+  if (!hosts[h].checking)
+    {
+      if (ncpu == -1 && (verbose || trace))
+        fprintf (trace ? trace : stderr, "forkargs: reprobe of '%s' failed\n",
+                 hosts[h].hostname ? hosts[h].hostname : "localhost");
+      return;
+    }
+  hosts[h].checking = 0;
+  if (hosts[h].auto_size)
+    ok = ncpu != -1;
+  else
+    ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!ok)
+    {
+      fprintf (stderr, "Warning: slot on '%s' inaccessible\n",
+               hosts[h].hostname ? hosts[h].hostname : "localhost");
+      for (i = 0; i < n_slots; i++)
+        if (slots[i].host == h)
+          slot_fault (i);
+      return;
+    }
+  hosts[h].warm = 1;
+  if (hosts[h].auto_size)
+    host_grow (h, ncpu);
+}
+
+/* Check every host that needs it, in the background. */
+void check_hosts (void)
+{
+  int h;
+  for (h = 0; h < n_hosts; h++)
+    if (hosts[h].auto_size || (hosts[h].hostname && !skip_slot_test))
+      host_check_start (h);
+}
+
+/* Kill any checks still running, when they are no longer needed. */
+void check_cancel (void)
+{
+  int h, status;
+  for (h = 0; h < n_hosts; h++)
+    if (hosts[h].probe_pid)
+      {
+        kill (hosts[h].probe_pid, SIGTERM);
+        waitpid (hosts[h].probe_pid, &status, 0);
+        hosts[h].probe_pid = 0;
+        if (hosts[h].probe_fd != -1)
+          close (hosts[h].probe_fd);
+        hosts[h].probe_fd = -1;
+      }
+}
+
+/* Deal with finished checks, and start the re-probes of 'auto' hosts
+   due by time T. Returns the time until the next re-probes, or -1 if
+   there are none. */
+double probe_poll (double t)
+{
+  int h;
+  for (h = 0; h < n_hosts; h++)
+    if (hosts[h].probe_exited)
+      host_check_done (h);
+  if (reprobe_interval <= 0)
+    return -1;
+  if (t >= reprobe_at)
+    {
+      for (h = 0; h < n_hosts; h++)
+        if (hosts[h].auto_size && hosts[h].warm && !hosts[h].probe_pid
+            && !hosts[h].checking)
+          probe_start (h);
+      reprobe_at = t + reprobe_interval;
+    }
+  return reprobe_at - t;
+}
+
+void zygote_kill (void)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].zygote_pid > 0)
+      kill (slots[i].zygote_pid, SIGTERM);
+}
 
-          if (*c && *c != ',' && *c != ':')
-            {
-              /* Hostname */
-              i = 0;
-              while (*c && (isalnum(*c) || *c == '-' || *c == '.'
-                            || *c == '@'))
-                hostname[i++] = *c++;
-              hostname[i++] = '\0';
-              
-              if (i == 1)
-                {
-                  fprintf (stderr, "Bad hostname: '%s'\n", c);
-                  exit(2);
-                }
-            }
+/* A zygote has gone: no more jobs for its slot. The job it was
+   running can no longer be reported on, so counts as failed. */
+void zygote_lost (int slot)
+{
+  if (slots[slot].zygote_fd == -1)
+    return;
+  if (verbose)
+    fprintf (stderr, "forkargs: lost zygote for slot %d\n", slot);
+  close (slots[slot].zygote_fd);
+  slots[slot].zygote_fd = -1;
+  slot_fault (slot);
+  if (slots[slot].cpid != -1)
+    job_finished (slots[slot].cpid, 255 << 8, "forkargs");
+}
 
-          if (*c == ':')
-            {
-              /* Working directory */
-              c++;
-              i = 0;
-              while (*c && *c != ',')
-                working_dir[i++] = *c++;
-              working_dir[i++] = '\0';
-            }
-          
-          /* Set up NUM_SLOTS slots for this entry. */
-          for (i = 0; i < num_slots; i++)
-            {
-              int a, ai;
-              char **slot_args;
-              char *host = NULL;
-              char *wd = NULL;
-              if (strcmp(hostname, "localhost") && strcmp(hostname, "-"))
-                host = strdup(hostname);
-              if (working_dir[0])
-                {
-                  wd = working_dir_str(working_dir, host != NULL);
-                }
-              a = 0;
-              slot_args = calloc (n_args + 2 + 2 + 3, sizeof(*slot_args));
-
-              /* For remote slots, we set up some arguments
-                 appropriately here: constructing the SSH command
-                 arguments so they're ready to go, rather than
-                 deferring this until we're ready to exec(). */
-              if (host)
-                {
-                  slot_args[a++] = "ssh";
-                  slot_args[a++] = host;
-                  if (wd)
-                    {
-                      slot_args[a++] = "cd";
-                      slot_args[a++] = escape_str(wd);
-                      slot_args[a++] = ";";
-                    }
+/* Handle one line from SLOT's zygote. If it reports a new job's pid,
+   return it through *PID and return 1. */
+int zygote_message (int slot, const char *line, pid_t *pid)
+{
+  int p, status;
+  if (!strcmp (line, "READY"))
+    slots[slot].zygote_ready = 1;
+  else if (sscanf (line, "PID %d", &p) == 1)
+    {
+      *pid = p;
+      return 1;
+    }
+  else if (sscanf (line, "EXIT %d %d", &p, &status) == 2)
+    {
+      spawner_exits = realloc (spawner_exits, sizeof (*spawner_exits)
+                               * (n_spawner_exits + 1));
+      spawner_exits[n_spawner_exits].type = EXITED;
+      spawner_exits[n_spawner_exits].pid = p;
+      spawner_exits[n_spawner_exits].status = status;
+      n_spawner_exits++;
+    }
+  else if (verbose)
+    fprintf (stderr, "forkargs: zygote %d: unexpected '%s'\n", slot, line);
+  return 0;
+}
 
-                  for (ai = 0; ai < n_args; ai++)
-                    slot_args[a++] = escape_str (args[ai]);
-                }
-              else
-                for (ai = 0; ai < n_args; ai++)
-                  slot_args[a++] = args[ai];
-
-              slots = realloc(slots, sizeof(*slots) * (++n_slots));
-              slots[n_slots -1].hostname = host;
-              slots[n_slots -1].cpid = -1;
-              slots[n_slots -1].args = slot_args;
-              slots[n_slots -1].n_args = a;
-              slots[n_slots -1].arg = NULL;
-              slots[n_slots -1].remote_slot = host != NULL;
-              slots[n_slots -1].working_dir = wd;
-            }
+/* Process everything the zygotes have sent. */
+void zygote_poll (void)
+{
+  char line[BUFSIZ];
+  pid_t pid;
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].zygote_fd != -1)
+      {
+        if (!linebuf_fill (slots[i].zygote_fd, slots[i].zygote_buf))
+          zygote_lost (i);
+        while (linebuf_line (slots[i].zygote_buf, line, sizeof (line)))
+          if (zygote_message (i, line, &pid))
+            fprintf (stderr, "forkargs: zygote %d: unrequested pid\n", i);
+        if (slots[i].zygote_fd != -1)
+          watch_fd (slots[i].zygote_fd);
+      }
+}
 
-          while (*c && isspace(*c))
-            c++;
-          
-          /* Comma separates slots */
-          if (*c)
-            if (*c == ',' && *(c + 1))
-              c++;              /* and then continue */
-            else
-              {
-                fprintf (stderr, "Bad slot description at '%s'\n", c);
-                exit (1);
-              }
-          else
-            break;
+/* Ask SLOT's zygote to run JOB, returning the new process's pid. A
+   zygote that does not answer within ZYGOTE_REPLY_TIMEOUT seconds is
+   killed, leaving the slot to fork its jobs in the ordinary way; -1 is
+   returned with SLOT's zygote_fd -1 but the slot not faulted. */
+pid_t zygote_spawn (int slot, Job *job)
+{
+  char line[BUFSIZ];
+  pid_t pid = -1;
+  int fd = slots[slot].zygote_fd;
+  double give_up = now () + ZYGOTE_REPLY_TIMEOUT, left;
+  struct timeval tv;
+  fd_set fds;
+  if (!write_full (fd, job->arg, strlen (job->arg)) || !write_full (fd, "\n", 1))
+    {
+      zygote_lost (slot);
+      errno = EPIPE;
+      return -1;
+    }
+  for (;;)
+    {
+      while (linebuf_line (slots[slot].zygote_buf, line, sizeof (line)))
+        if (zygote_message (slot, line, &pid))
+          {
+            if (pid == -1)
+              errno = EAGAIN;
+            return pid;
+          }
+      left = give_up - now ();
+      if (left <= 0)
+        {
+          fprintf (stderr, ("forkargs: zygote for slot %d not answering,"
+                            " forking jobs directly\n"), slot);
+          kill (slots[slot].zygote_pid, SIGKILL);
+          close (fd);
+          slots[slot].zygote_fd = -1;
+          errno = ETIMEDOUT;
+          return -1;
+        }
+      FD_ZERO (&fds);
+      FD_SET (fd, &fds);
+      tv.tv_sec = (long) left;
+      tv.tv_usec = (long) ((left - tv.tv_sec) * 1e6);
+      if (select (fd + 1, &fds, NULL, NULL, &tv) <= 0)
+        continue;               /* timed out, or interrupted */
+      if (!linebuf_fill (fd, slots[slot].zygote_buf))
+        {
+          zygote_lost (slot);
+          errno = EPIPE;
+          return -1;
+        }
+    }
+}
 
-        } /* while (*c) */
+/* Start a session for remote SLOT's next job at time T: ssh to the
+   host, and have the remote shell wait for the command line on stdin.
+   The connection is then set up before there is a job for it, and is
+   charged to the start rate limits in place of the job's. */
+void prewarm_start (int slot, double t)
+{
+  char **args = calloc (slots[slot].remote_arg + 2, sizeof (*args));
+  int fds[2];
+  pid_t pid;
+  memcpy (args, slots[slot].args, slots[slot].remote_arg * sizeof (*args));
+  args[slots[slot].remote_arg] = "IFS= read -r line && eval \"$line\"";
+  if (pipe (fds) == -1)
+    {
+      free (args);
+      return;
+    }
+  pid = fork ();
+  if (pid == 0)
+    {
+      signal (SIGCHLD, SIG_DFL);
+      signal (SIGPIPE, SIG_DFL);
+      close (fds[1]);
+      dup2 (fds[0], STDIN_FILENO);
+      close (fds[0]);
+      execvp (args[0], args);
+      perror (args[0]);
+      _exit (127);
     }
+  free (args);
+  close (fds[0]);
+  if (pid == -1)
+    {
+      close (fds[1]);
+      return;
+    }
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+  slots[slot].warm_pid = pid;
+  slots[slot].warm_fd = fds[1];
+  slots[slot].warm_started = t;
+  slots[slot].warm_wanted = 0;
+  bucket_take (&start_bucket);
+  bucket_take (&hosts[slots[slot].host].start_bucket);
+}
 
-  /* Synchronise working directory */
-  if (sync_working_dirs)
+/* Close the stdin of every waiting session, so that they exit. */
+void prewarm_stop (void)
+{
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].warm_fd != -1)
+      {
+        close (slots[i].warm_fd);
+        slots[i].warm_fd = -1;
+      }
+}
+
+/* Hand JOB to SLOT's waiting session, returning the session's pid, or
+   -1 if it has gone away. */
+pid_t prewarm_spawn (int slot, Job *job, const char *prog)
+{
+  char **args = slots[slot].args;
+  size_t len = 2;
+  char *line, *arg = escape_str (job->arg);
+  pid_t pid = slots[slot].warm_pid;
+  int i, ok;
+  for (i = slots[slot].remote_arg; i < slots[slot].n_args; i++)
+    len += strlen (args[i]) + 1;
+  line = malloc (len + strlen (arg));
+  line[0] = '\0';
+  for (i = slots[slot].remote_arg; i < slots[slot].n_args; i++)
     {
-      char **args;
-      char *local_args[] = {
-        "rsync", "--delete", "-ravu", "./", NULL, NULL
-      };
-      const int local_args_dest_i = 4;
-      char *remote_args[] = {
-        "rsync", "--delete", "-e", "ssh", "-ravu", "./", NULL, NULL
-      };
-      const int remote_args_dest_i = 6;
-      assert(local_args[local_args_dest_i] == NULL
-             && local_args[local_args_dest_i+1] == NULL);
-      assert(remote_args[remote_args_dest_i] == NULL
-             && remote_args[remote_args_dest_i+1] == NULL);
-      /* Check that all slots have a specified working directory */
-      for (i = 0; i < n_slots; i++)
+      strcat (line, args[i]);
+      strcat (line, " ");
+    }
+  strcat (line, arg);
+  free (arg);
+  if (trace)
+    fprintf (trace, "%s: sending '%s' to session %d\n", prog, line, pid);
+  if (verbose)
+    fprintf (stderr, "forkargs: (%s) %s\n", slots[slot].hostname, line);
+  strcat (line, "\n");
+  ok = write_full (slots[slot].warm_fd, line, strlen (line));
+  free (line);
+  /* Closing stdin leaves the job reading end of file, as it would
+     from /dev/null. */
+  close (slots[slot].warm_fd);
+  slots[slot].warm_fd = -1;
+  if (!ok)
+    return -1;                  /* reaped by helper_exited() */
+  slots[slot].warm_pid = 0;
+  slots[slot].connect_at = slots[slot].warm_started;
+  return pid;
+}
+
+/* Fork the remote session for the batch of jobs from JOB in SLOT,
+   with its output through a pipe so that the status lines can be
+   picked out. Batches are forked here rather than by the spawner, as
+   the pipe has to reach forkargs. */
+pid_t batch_spawn (int slot, Job *job, const char *prog)
+{
+  int fds[2], err;
+  pid_t cpid;
+  if (pipe (fds) == -1)
+    return -1;
+  cpid = fork ();
+  if (cpid == 0)
+    {
+      signal (SIGCHLD, SIG_DFL);
+      close (fds[0]);
+      dup2 (fds[1], STDOUT_FILENO);
+      close (fds[1]);
+      exec_job (slot, job, prog);
+    }
+  err = errno;
+  close (fds[1]);
+  if (cpid == -1)
+    {
+      close (fds[0]);
+      errno = err;
+      return -1;
+    }
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  slots[slot].batch_fd = fds[0];
+  if (!slots[slot].batch_buf)
+    slots[slot].batch_buf = calloc (1, sizeof (LineBuf));
+  slots[slot].batch_buf->len = 0;
+  return cpid;
+}
+
+/* Start JOB in SLOT, returning the child's pid (or -1, with errno
+   set) in the parent. */
+pid_t spawn_job (int slot, Job *job, const char *prog)
+{
+  pid_t cpid;
+  if (FAULT ("fork-eagain"))
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  if (job->next)
+    return batch_spawn (slot, job, prog);
+  if (slots[slot].warm_fd != -1)
+    {
+      cpid = prewarm_spawn (slot, job, prog);
+      if (cpid != -1)
+        return cpid;
+    }
+  if (slots[slot].zygote_fd != -1)
+    {
+      cpid = zygote_spawn (slot, job);
+      if (cpid != -1 || slots[slot].zygote_fd != -1 || slots[slot].faulted)
+        return cpid;
+      /* The zygote timed out: fork the job as without --zygote. */
+    }
+  if (spawner_fd != -1)
+    {
+      SpawnRequest req;
+      SpawnReply reply;
+      req.type = SPAWN_JOB;
+      req.slot = slot;
+      req.sched_class = job->sched_class;
+      req.len = strlen (job->arg);
+      if (!write_full (spawner_fd, &req, sizeof (req))
+          || !write_full (spawner_fd, job->arg, req.len))
         {
-          if (slots[i].working_dir == NULL)
-            {
-              fprintf (stderr, ("forkargs: must specify working directory "
-                                "when synchronising work dirs\n"));
-            }
+          fprintf (stderr, "forkargs: lost spawner process\n");
+          exit (1);
         }
-      for (i = 0; i < n_slots; i++)
+      for (;;)
         {
-          int j;
-          /* Check that we haven't already encountered this host:dir pair before. */
-          for (j = 0; j < i; j++)
-            if (!strcmp (slots[i].hostname, slots[j].hostname)
-                && !strcmp (slots[i].working_dir, slots[j].working_dir))
-              break;
-          if (i != j)
-            continue;
-          assert (0);
+          spawner_read (&reply);
+          if (reply.type == SPAWNED)
+            break;
+          spawner_exits = realloc (spawner_exits, sizeof (*spawner_exits)
+                                   * (n_spawner_exits + 1));
+          spawner_exits[n_spawner_exits++] = reply;
         }
+      errno = reply.status;
+      return reply.pid;
+    }
+
+  cpid = fork ();
+  if (cpid == 0)
+    {
+      /* Child. Execute the process. */
+      signal (SIGCHLD, SIG_DFL);
+      exec_job (slot, job, prog);
     }
+  return cpid;
 }
 
-/* Test remote slots to make sure they're accessible. */
-static void test_slots(int argc, char *argv[])
+/* Handle the exit of a non-job child CPID. Returns 1 if it was one. */
+int helper_exited (pid_t cpid, int status)
 {
   int i;
-  char *args[] = {
-    "ssh",
-    NULL,
-    "true",
-    NULL
-  };
-  /* Check each slot explicitly.
-     TODO: if we have multiple remote hosts, it would be neat to be
-     able to run these in parallel. */
   for (i = 0; i < n_slots; i++)
+    if (slots[i].zygote_pid == cpid)
+      {
+        /* Its job's process may hold the socket open, so do not wait
+           for it to close. */
+        fprintf (stderr, "forkargs: zygote for slot %d exited\n", i);
+        slots[i].zygote_pid = 0;
+        zygote_lost (i);
+        return 1;
+      }
+  if (cpid == spawner_pid)
     {
-      if (slots[i].hostname && strcmp(slots[i].hostname, "localhost"))
+      if (spawner_fd != -1)
         {
-          int cpid;
-          int j;
-          /* Have we already tested this hostname? Eww O(n^2). But n
-             is small. */
-          for (j = 0; j < i; j++)
-            if (slots[j].hostname && !strcmp(slots[j].hostname,
-                                             slots[i].hostname))
-              break;
-          if (j != i)
-            {
-              slots[i].faulted = slots[j].faulted;
-              continue;
-            }
-
-          args[1] = slots[i].hostname;
-          if (verbose)
-            {
-              fprintf (stderr, "forkargs: testing remote slot on '%s'\n",
-                       slots[i].hostname);
-            }
-          cpid = fork();
-          if (cpid == -1)
-            {
-              perror(argv[0]);
-              exit(1);
-            }
-          else if (cpid)
-            {
-              /* Parent */
-              int status;
-              cpid = waitpid(cpid, &status, 0);
-              if (WEXITSTATUS(status) != 0)
-                {
-                  fprintf (stderr, "Warning: slot on '%s' inaccessible\n",
-                           slots[i].hostname);
-                  slots[i].faulted = 1;
-                }
-            }
-          else
-            {
-              /* Child */
-              int status;
-              close(STDIN_FILENO);
-              open("/dev/null", O_RDONLY);
-              status = execvp(slots[i].args[0], args);
-              if (status == -1)
-                {
-                  perror(slots[i].args[0]);
-                  exit(1);
-                }
-              else
-                {
-                  exit(0);
-                }
-            }
+          fprintf (stderr, "forkargs: spawner process died\n");
+          exit (1);
         }
+      return 1;
     }
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].warm_pid == cpid)
+      {
+        /* A waiting session gave up; the next job starts afresh. */
+        slots[i].warm_pid = 0;
+        if (slots[i].warm_fd != -1)
+          close (slots[i].warm_fd);
+        slots[i].warm_fd = -1;
+        return 1;
+      }
+  for (i = 0; i < n_hosts; i++)
+    if (hosts[i].probe_pid == cpid)
+      {
+        /* Dealt with by probe_poll(). */
+        hosts[i].probe_pid = 0;
+        hosts[i].probe_exited = 1;
+        hosts[i].probe_status = status;
+        return 1;
+      }
+  for (i = 0; i < n_cleaners; i++)
+    if (cleaners[i] == cpid)
+      {
+        cleaners[i] = cleaners[--n_cleaners];
+        return 1;
+      }
+  for (i = 0; i < n_hooks; i++)
+    if (hooks[i] == cpid)
+      {
+        hooks[i] = hooks[--n_hooks];
+        return 1;
+      }
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].sandbox_pid == cpid)
+      {
+        fprintf (stderr, "forkargs: sandbox for slot %d died (status %d)\n",
+                 i, status);
+        slots[i].sandbox_pid = 0;
+        slot_fault (i);
+        return 1;
+      }
+  return 0;
 }
 
-static char *
-read_line_offset (FILE *in,
-                  size_t offset)
+/* Collect any children that have terminated, without blocking. */
+void reap_children (const char *prog)
 {
-  char buffer[BUFSIZ];
-  char *result = NULL;
-  if (!feof(in)
-      && fgets(buffer, BUFSIZ, in))
+  pid_t cpid;
+  int status;
+  int i, err;
+  while ((cpid = waitpid (-1, &status, WNOHANG)) > 0)
+    if (!helper_exited (cpid, status))
+      job_finished (cpid, status, prog);
+  err = errno;
+  if (use_zygote)
+    zygote_poll ();
+  if (batch_size > 1)
+    for (i = 0; i < n_slots; i++)
+      if (slots[i].batch_fd != -1)
+        {
+          batch_read (i);
+          watch_fd (slots[i].batch_fd);
+        }
+  for (i = 0; i < n_spawner_exits; i++)
+    job_finished (spawner_exits[i].pid, spawner_exits[i].status, prog);
+  n_spawner_exits = 0;
+  if (spawner_fd != -1)
     {
-      size_t len = strlen(buffer);
-      if (strstr(buffer, "\n") == NULL)
+      fd_set fds;
+      struct timeval tv = { 0, 0 };
+      for (;;)
         {
-          /* No newline in this, so get the rest of the string. */
-          result = read_line_offset(in, offset + len);
+          SpawnReply reply;
+          FD_ZERO (&fds);
+          FD_SET (spawner_fd, &fds);
+          if (select (spawner_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+          spawner_read (&reply);
+          job_finished (reply.pid, reply.status, prog);
         }
+      watch_fd (spawner_fd);
+    }
+  jobserver_release_surplus ();
+  if (cpid == -1 && err != ECHILD && err != EINTR)
+    {
+      errno = err;
+      perror (prog);
+      exit (1);
+    }
+}
+
+/* Sleep until a child exits, a signal arrives, or TIMEOUT seconds
+   have passed. A negative TIMEOUT waits indefinitely. */
+void wait_for_event (double timeout)
+{
+  struct timeval tv;
+  char buf[64];
+  double t0 = prof_begin ();
+  if (FAULT ("eintr"))
+    {
+      FD_ZERO (&watch_fds);
+      max_watch_fd = -1;
+      return;
+    }
+  watch_fd (sigchld_pipe[0]);
+  if (timeout >= 0)
+    {
+      long usec = (long) (timeout * 1e6) + 1;
+      tv.tv_sec = usec / 1000000;
+      tv.tv_usec = usec % 1000000;
+    }
+  if (select (max_watch_fd + 1, &watch_fds, NULL, NULL,
+              timeout >= 0 ? &tv : NULL) > 0)
+    while (read (sigchld_pipe[0], buf, sizeof (buf)) > 0)
+      ;
+  FD_ZERO (&watch_fds);
+  max_watch_fd = -1;
+  prof_end (PROF_WAIT, t0);
+}
+
+/* Efficiency mode: order slots so that busy hosts are filled first,
+   then hosts in their order in the slot table. */
+int pack_compare (const void *a, const void *b)
+{
+  int i = *(const int *) a, j = *(const int *) b;
+  int ri = hosts[slots[i].host].running, rj = hosts[slots[j].host].running;
+  if (ri != rj)
+    return rj - ri;
+  return i - j;
+}
+
+/* The most jobs to run at once to keep up the target rate, given the
+   average job runtime, or to meet the deadline: no limit until a job
+   has completed. */
+int pack_limit (void)
+{
+  int limit = deadline_cap;
+  if (target_rate > 0 && runtime_avg > 0
+      && target_rate * runtime_avg + 1 < limit)
+    limit = (int) (target_rate * runtime_avg) + 1;
+  return limit;
+}
+
+/* Run the idle hook for hosts idle for idle_after seconds at time T.
+   Returns the time until the next might be due, or -1. */
+double idle_poll (double t)
+{
+  double wake = -1;
+  int h;
+  if (!idle_hook)
+    return -1;
+  for (h = 1; h < n_hosts; h++)
+    if (!hosts[h].running && !hosts[h].idle_hooked)
+      {
+        double due = hosts[h].idle_since + idle_after - t;
+        pid_t pid;
+        if (due > 0)
+          {
+            if (wake < 0 || due < wake)
+              wake = due;
+            continue;
+          }
+        if (verbose || trace)
+          fprintf (trace ? trace : stderr, "forkargs: %s idle, running '%s'\n",
+                   hosts[h].hostname, idle_hook);
+        hosts[h].idle_hooked = 1;
+        pid = fork ();
+        if (pid == 0)
+          {
+            close (STDIN_FILENO);
+            open ("/dev/null", O_RDONLY);
+            setenv ("FORKARGS_HOST", hosts[h].hostname, 1);
+            execlp ("sh", "sh", "-c", idle_hook, "sh", hosts[h].hostname,
+                    (char *) NULL);
+            _exit (127);
+          }
+        if (pid > 0)
+          {
+            hooks = realloc (hooks, sizeof (*hooks) * (n_hooks + 1));
+            hooks[n_hooks++] = pid;
+          }
+      }
+  return wake;
+}
+
+/* Estimated seconds of work left, in jobs running or still to start,
+   or -1 if that is not known. The number of jobs not yet read is
+   judged from the rest of the input and the average line length. */
+double deadline_work (int input_eof)
+{
+  double jobs = stats.read - stats.dropped - stats.finished;
+  if (runtime_avg <= 0)
+    return -1;
+  if (!input_eof)
+    {
+      if (input_size < 0 || !input_offset)
+        return -1;
+      jobs += (double) (input_size - input_offset) * stats.read / input_offset;
+    }
+  return jobs * runtime_avg;
+}
+
+/* Add the slots described by LINE, from the deadline hook. */
+void deadline_add (const char *line)
+{
+  int first = n_slots, h = n_hosts, i;
+  if (!*line || line[strspn (line, ("abcdefghijklmnopqrstuvwxyz"
+                                    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                    "0123456789*,:@._-/~ "))])
+    {
+      fprintf (stderr, "forkargs: bad slots from deadline hook: '%s'\n", line);
+      return;
+    }
+  if (add_slots (line, slot_cmd, n_slot_cmd))
+    {
+      fprintf (stderr, "forkargs: ignoring slots from deadline hook: '%s'\n",
+               line);
+      return;
+    }
+  for (i = first; i < n_slots; i++)
+    slot_added (i);
+  if (verbose || trace)
+    fprintf (trace ? trace : stderr, "forkargs: added slots '%s'\n", line);
+  for (; h < n_hosts; h++)
+    {
+      hosts[h].idle_since = now ();
+      if (hosts[h].auto_size || !skip_slot_test)
+        host_check_start (h);
+    }
+}
+
+/* Run the deadline hook, for NEED more slots. */
+void deadline_hook_start (int need)
+{
+  int fds[2];
+  char num[32];
+  pid_t pid;
+  if (pipe (fds) == -1)
+    {
+      perror ("forkargs: deadline hook");
+      return;
+    }
+  pid = fork ();
+  if (pid == -1)
+    {
+      perror ("forkargs: deadline hook");
+      close (fds[0]);
+      close (fds[1]);
+      return;
+    }
+  if (pid == 0)
+    {
+      close (fds[0]);
+      dup2 (fds[1], STDOUT_FILENO);
+      close (STDIN_FILENO);
+      open ("/dev/null", O_RDONLY);
+      sprintf (num, "%d", need);
+      setenv ("FORKARGS_SLOTS_NEEDED", num, 1);
+      execlp ("sh", "sh", "-c", deadline_hook, "sh", num, (char *) NULL);
+      _exit (127);
+    }
+  close (fds[1]);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  deadline_fd = fds[0];
+  if (!deadline_buf)
+    deadline_buf = calloc (1, sizeof (LineBuf));
+  deadline_buf->len = 0;
+  hooks = realloc (hooks, sizeof (*hooks) * (n_hooks + 1));
+  hooks[n_hooks++] = pid;
+}
+
+/* Set the number of jobs to run at once to finish by the deadline, as
+   of time T, from the work left and the time to do it in. If that is
+   more than there are slots, warn, and run the deadline hook, taking
+   its output as more slots. Returns the time until the hook may be
+   run again, or -1. */
+double deadline_poll (double t, int input_eof)
+{
+  char line[BUFSIZ];
+  double work, left = deadline - t;
+  int usable = 0, need, i;
+  if (!deadline)
+    return -1;
+  if (deadline_fd != -1)
+    {
+      int more = linebuf_fill (deadline_fd, deadline_buf);
+      while (linebuf_line (deadline_buf, line, sizeof (line)))
+        deadline_add (line);
+      if (more)
+        watch_fd (deadline_fd);
       else
         {
-          /* We've read a newline. Allocate a buffer and set the
-             terminating end of line character. */
-          result = malloc (len + 1 + offset);
-          result[len + offset] = '\0';
+          close (deadline_fd);
+          deadline_fd = -1;
+        }
+    }
+  deadline_cap = INT_MAX;
+  work = deadline_work (input_eof);
+  if (work < 0)
+    return -1;
+  if (left <= 0)
+    {
+      if (deadline_slipping < 2 && work > 0)
+        fprintf (stderr, "forkargs: deadline passed, about %.0fs of work"
+                 " left\n", work);
+      deadline_slipping = 2;
+      return -1;
+    }
+  need = (int) (work / left) + 1;
+  deadline_cap = need;
+  for (i = 0; i < n_slots; i++)
+    if (!slots[i].faulted && slots[i].host_rank < hosts[slots[i].host].slot_limit)
+      usable++;
+  if (need <= usable)
+    {
+      deadline_slipping = 0;
+      return -1;
+    }
+  if (!deadline_slipping)
+    fprintf (stderr, "forkargs: projected to finish %.0fs after the deadline;"
+             " %d more slots needed\n",
+             work / (usable ? usable : 1) - left, need - usable);
+  deadline_slipping = 1;
+  if (!deadline_hook)
+    return -1;
+  if (deadline_fd == -1 && t >= deadline_hook_at)
+    {
+      if (verbose || trace)
+        fprintf (trace ? trace : stderr, "forkargs: running '%s'\n",
+                 deadline_hook);
+      deadline_hook_start (need - usable);
+      deadline_hook_at = t + DEADLINE_HOOK_INTERVAL;
+    }
+  return deadline_hook_at - t;
+}
+
+/* Does starting a job in SLOT set up a new connection? */
+int slot_connects (int slot)
+{
+  Host *host = &hosts[slots[slot].host];
+  return slots[slot].remote_slot
+    && ((host->transport_hints & TRANSPORT_SLOW_START)
+        || ((host->transport_hints & TRANSPORT_MULTIPLEX) && !host->warm));
+}
+
+/* Check the start rate limits for a job in SLOT at time T. Returns 0
+   if the job may start now, or the delay before it might. A job
+   handed to a waiting session is not limited: the session was, when
+   it connected. */
+double start_delay (int slot, double t)
+{
+  double delay, d;
+  if (slots[slot].warm_fd != -1)
+    return 0;
+  delay = bucket_delay (&start_bucket, t);
+  d = bucket_delay (&hosts[slots[slot].host].start_bucket, t);
+  if (d > delay)
+    delay = d;
+
+  if (max_connecting > 0 && slot_connects (slot))
+    {
+      /* Remote jobs and waiting sessions count as setting up a
+         connection for their first 'connect_time' seconds. */
+      int i, n = 0;
+      double first = -1;
+      for (i = 0; i < n_slots; i++)
+        if (slot_connects (i))
+          {
+            if (slots[i].cpid != -1
+                && t - slots[i].connect_at < connect_time)
+              {
+                n++;
+                if (first < 0 || slots[i].connect_at < first)
+                  first = slots[i].connect_at;
+              }
+            if (slots[i].warm_pid
+                && t - slots[i].warm_started < connect_time)
+              {
+                n++;
+                if (first < 0 || slots[i].warm_started < first)
+                  first = slots[i].warm_started;
+              }
+          }
+      if (n >= max_connecting && first + connect_time - t > delay)
+        delay = first + connect_time - t;
+    }
+  return delay;
+}
+
+/* Start a waiting session for each usable remote slot that wants one
+   (at the start, and once its last session has taken a job), as the
+   start limits allow. Returns the delay before another might
+   be started, or -1. */
+double prewarm_poll (double t)
+{
+  double wake = -1, delay;
+  int i;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].warm_wanted && !slots[i].warm_pid && !slots[i].faulted
+        && !hosts[slots[i].host].checking
+        && slots[i].host_rank < hosts[slots[i].host].slot_limit)
+      {
+        delay = start_delay (i, t);
+        if (delay <= 0)
+          prewarm_start (i, t);
+        else if (wake < 0 || delay < wake)
+          wake = delay;
+      }
+  return wake;
+}
+
+int accepting_input (void)
+{
+  return !interrupted && (!error_encountered || continue_on_error);
+}
+
+/* Put the jobs in chain JOB back at the head of the held jobs. */
+void hold_jobs (Job *job)
+{
+  Job *last = job;
+  while (last->next)
+    last = last->next;
+  last->next = held_jobs;
+  held_jobs = job;
+}
+
+/* Read a new job from the input if input is still being accepted.
+   Sets *INPUT_EOF at the end of the input. */
+Job *read_job (int *input_eof)
+{
+  char *str;
+  double t0;
+  Job *job;
+  if (*input_eof || !accepting_input ())
+    return NULL;
+  t0 = prof_begin ();
+  str = read_line (in_arguments);
+  if (!str)
+    {
+      *input_eof = 1;
+      prof_end (PROF_INPUT, t0);
+      return NULL;
+    }
+  /* Strip newline */
+  {
+    char *nl = strstr (str, "\n");
+    if (nl)
+      *nl = '\0';
+  }
+  job = make_job (str);
+  prof_end (PROF_INPUT, t0);
+  return job;
+}
+
+/* Fair share: with up to 'lookahead' jobs read ahead, take the one
+   whose submitter has the fewest jobs running for its weight, among
+   those below their quota, and the earliest such. Work queued by a
+   busy submitter is thus overtaken by others'. Returns NULL if every
+   waiting submitter is at its quota. */
+Job *fair_take_job (int *input_eof)
+{
+  Job **j, **best = NULL, *job;
+  double best_share = 0;
+  int n = 0;
+  for (j = &held_jobs; *j; j = &(*j)->next)
+    n++;
+  for (; n < lookahead && (job = read_job (input_eof)); n++)
+    {
+      *j = job;
+      j = &job->next;
+    }
+  for (j = &held_jobs; *j; j = &(*j)->next)
+    {
+      Submitter *sub = &submitters[(*j)->submitter];
+      double share = sub->running / sub->weight;
+      if (sub->quota && sub->running >= sub->quota)
+        continue;
+      if (!best || share < best_share
+          || (share == best_share && (*j)->seq < (*best)->seq))
+        {
+          best = j;
+          best_share = share;
         }
-
-      /* Copy the buffer into the result. */
-      strncpy(&(result[offset]), buffer, len);
     }
-  return result;
+  if (!best)
+    return NULL;
+  job = *best;
+  *best = job->next;
+  job->next = NULL;
+  return job;
 }
 
+/* The next job to consider: one held back earlier, or a new line of
+   input. Sets *INPUT_EOF at the end of the input. */
+Job *take_job (int *input_eof)
+{
+  Job *job = held_jobs;
+  if (fair_share)
+    return fair_take_job (input_eof);
+  if (job)
+    {
+      held_jobs = job->next;
+      job->next = NULL;
+      return job;
+    }
+  return read_job (input_eof);
+}
 
-char *
-read_line (FILE *in)
+/* Chain up to batch_size - 1 more jobs after JOB, to run in the same
+   remote session, claiming their resources. A job whose resources
+   are not available now ends the batch, and is held for later. */
+void batch_gather (Job *job, int *input_eof)
 {
-  return read_line_offset (in, 0);
+  Job *tail = job, *j;
+  int n;
+  /* Count the batch's jobs as running while it is gathered, so that
+     fair_take_job() keeps to the share quotas; they are counted for
+     good once the batch starts. */
+  if (fair_share)
+    submitters[job->submitter].running++;
+  for (n = 1; n < batch_size; n++)
+    {
+      Job *next = take_job (input_eof);
+      if (!next)
+        break;
+      if (resources_available (next) <= 0)
+        {
+          hold_jobs (next);
+          break;
+        }
+      claim_resources (next, 1);
+      if (fair_share)
+        submitters[next->submitter].running++;
+      tail->next = next;
+      tail = next;
+    }
+  if (fair_share)
+    for (j = job; j; j = j->next)
+      submitters[j->submitter].running--;
 }
 
-void help (void)
+/* Undo batch_gather() after a failed spawn. */
+void batch_undo (Job *job)
 {
-  fprintf (stdout, ("Syntax: forkargs -t<out> -j<n>\n"));
-  fprintf (stdout, (" -j<n>   Maximum of <n> parallel jobs\n"));
-  fprintf (stdout, (" -k      Continue on errors.\n"));
-  fprintf (stdout, (" -v      Verbose\n"));
-  fprintf (stdout, (" -t<out> trace process control info to <out>\n"));
-  fprintf (stdout, (" -n      "
-                    "Do not test accessibility of remote machines"
-                    " before issuing commands to them.\n"));
-  fprintf (stdout, (" -f<file> Take input arguments from file rather than"
-                    " stdin.\n"));
-  fprintf (stdout, (" -sync   Synchronise working directories before (and \n"
-                    "         after running)\n"));
+  Job *j;
+  if (!job->next)
+    return;
+  for (j = job->next; j; j = j->next)
+    claim_resources (j, -1);
+  hold_jobs (job->next);
+  job->next = NULL;
 }
 
-void bad_arg (char *arg)
+/* Can the run use run_fast()? Only if every slot is local with no
+   working directory, and nothing that needs the event loop or work
+   in the child is enabled. */
+int fast_path_possible (void)
 {
-  fprintf (stderr, "Bad argument: '%s'\n", arg);
-  help ();
-  exit (2);
+  int i;
+  if (trace || verbose || start_bucket.rate > 0 || host_start_limit.rate > 0
+      || ramp_mode != RAMP_NONE || n_resources || job_tags
+      || jobserver_rfd != -1 || token_socket || sandbox || scratch_base
+      || use_spawner || use_zygote || joblog || commit_file || fair_share
+      || pack || target_rate > 0 || idle_hook || deadline
+      || n_sched_classes)
+    return 0;
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].remote_slot || slots[i].working_dir || slots[i].faulted
+        || hosts[slots[i].host].auto_size)
+      return 0;
+  return 1;
 }
 
-void missing_arg(char *arg)
+/* Start ARGS with vfork(), its stdin from DEVNULL. The child shares
+   our memory until it execs, so it only redirects stdin and execs,
+   reporting failure with write() rather than through stdio. Kept out
+   of run_fast() so that none of its variables are live across the
+   vfork(). */
+pid_t vfork_exec (char **args, int devnull)
 {
-  fprintf (stderr, "Missing parameter to argument: '%s'\n", arg);
-  help ();
-  exit (2);
+  pid_t cpid = vfork ();
+  if (cpid == 0)
+    {
+      char msg[256];
+      ssize_t n;
+      if (dup2 (devnull, STDIN_FILENO) != -1)
+        execvp (args[0], args);
+      snprintf (msg, sizeof (msg), "%s: %s\n", args[0], strerror (errno));
+      n = write (STDERR_FILENO, msg, strlen (msg));
+      (void) n;
+      _exit (1);
+    }
+  return cpid;
 }
 
-/* Parse command-line arguments */
-void parse_args(int argc, char *argv[], int *first_arg_p)
+/* The dispatch loop for the common all-local, no-frills case: block
+   in wait() for a free slot, and start jobs with vfork(), whose cost
+   does not depend on forkargs' size. */
+void run_fast (const char *prog)
 {
-  int i;
-  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+  char *str;
+  int devnull = open ("/dev/null", O_RDONLY);
+  int i, status;
+  pid_t cpid;
+
+  if (devnull == -1)
     {
-      if (argv[i][1] == 'j')
-        {
-          if (argv[i][2])
-            /* '-j<string>' */
-            slots_string = &argv[i][2];
-          else if (i + 1 < argc)
-            /* '-j' '<string>' */
-            slots_string = argv[++i];
-          else
-            missing_arg (argv[i]);
-        }
-      else if (argv[i][1] == 'k' && !argv[i][2])
-        continue_on_error = 1;
-      else if (argv[i][1] == 'v' && !argv[i][2])
-        verbose = 1;
-      else if (argv[i][1] == 'n' && !argv[i][2])
-        skip_slot_test = 1;
-      else if (argv[i][1] == 't')
+      perror ("/dev/null");
+      exit (1);
+    }
+  fcntl (devnull, F_SETFD, FD_CLOEXEC);
+
+  for (;;)
+    {
+      char **args;
+      int n;
+      char *nl;
+      double t0 = prof_begin ();
+      if (!accepting_input () || !(str = read_line (in_arguments)))
+        break;
+      nl = strchr (str, '\n');
+      if (nl)
+        *nl = '\0';
+      prof_end (PROF_INPUT, t0);
+
+    retry:
+      while (n_active >= (spawn_limit ? spawn_limit : n_slots))
         {
-          const char *trace_name = "-";
-          if (argv[i][2])
-            /* '-t<filename>' */
-            trace_name = &argv[i][2];
-          else if (i + 1 < argc)
-            /* '-t <filename>' */
-            trace_name = argv[++i];
-          else
-            /* '-t' */
-            missing_arg (argv[i]);
-          if (trace_name[0] == '-' && trace_name[1] == '\0')
-            trace = stderr;
-          else
-            trace = fopen (trace_name, "w");
-          if (trace_name && !trace)
+          t0 = prof_begin ();
+          cpid = FAULT ("eintr") ? (errno = EINTR, -1) : wait (&status);
+          prof_end (PROF_WAIT, t0);
+          if (cpid > 0)
             {
-              fprintf (stderr, "Cannot open trace file '%s'\n", trace_name);
-              exit (0);
+              t0 = prof_begin ();
+              job_finished (cpid, status, prog);
+              prof_end (PROF_REAP, t0);
+            }
+          else if (errno != EINTR)
+            {
+              perror (prog);
+              exit (1);
             }
         }
-      else if (argv[i][1] == 'f')
+      for (i = 0; slots[i].cpid != -1; i++)
+        ;
+
+      args = slots[i].args;
+      n = slots[i].n_args;
+      args[n] = str;
+      args[n + 1] = NULL;
+      t0 = prof_begin ();
+      cpid = (FAULT ("fork-eagain") ? (errno = EAGAIN, -1)
+              : vfork_exec (args, devnull));
+      prof_end (PROF_FORK, t0);
+      if (cpid == -1)
         {
-          const char *in_arguments_name = "-";
-          if (argv[i][2])
-            in_arguments_name = &argv[i][2];
-          else if (i + 1 < argc)
-            in_arguments_name = argv[++i];
-          else
-            missing_arg (argv[i]);
-          if (in_arguments_name[0] == '-' && in_arguments_name[1] == '\0')
-            in_arguments = stdin;
-          else
-            in_arguments = fopen(in_arguments_name, "r");
-          if (!in_arguments)
+          if (!spawn_error_transient (errno))
             {
-              fprintf (stderr, "Cannot open input file '%s'\n",
-                       in_arguments_name);
-              exit (0);
+              perror (prog);
+              exit (1);
+            }
+          spawn_failed (now (), prog);
+          /* Retry once a job has finished, freeing a process, or if
+             there are none, after the backoff delay. */
+          if (n_active)
+            {
+              cpid = wait (&status);
+              if (cpid > 0)
+                job_finished (cpid, status, prog);
             }
+          else
+            usleep ((useconds_t) (spawn_backoff * 1e6));
+          goto retry;
         }
-      else if (argv[i][1] == 'h' || (argv[i][1] == '-' && argv[i][2] == 'h'))
+      spawn_backoff = 0;
+      slots[i].cpid = cpid;
+      slots[i].job = make_job (str);
+      n_active++;
+      stats.started++;
+      if (FAULT ("kill-child"))
+        kill (cpid, SIGKILL);
+    }
+
+  while (n_active)
+    {
+      double t0 = prof_begin ();
+      cpid = wait (&status);
+      prof_end (PROF_WAIT, t0);
+      if (cpid > 0)
         {
-          help();
-          exit (0);
+          t0 = prof_begin ();
+          job_finished (cpid, status, prog);
+          prof_end (PROF_REAP, t0);
         }
-      else if (!strcmp(argv[i], "sync"))
+      else if (errno != EINTR)
         {
-          sync_working_dirs = 1;
+          perror (prog);
+          exit (1);
         }
-      else
-        bad_arg (argv[i]);
     }
-  *first_arg_p = i;
+}
+
+/* Report the job accounting, and in fault injection builds check
+   that every job read was started or deliberately dropped, that every
+   job started finished, and that no children are left behind. */
+void check_invariants (const char *prog)
+{
+  if (trace)
+    fprintf (trace, "%s: %ld read, %ld started, %ld finished, %ld dropped\n",
+             prog, stats.read, stats.started, stats.finished, stats.dropped);
+  if (stats.spawn_failures && (trace || verbose))
+    fprintf (trace ? trace : stderr,
+             "%s: %ld failed spawns, concurrency backed off to %d\n",
+             prog, stats.spawn_failures, stats.min_spawn_limit);
+#if defined(FORKARGS_FAULTS)
+  int ok = 1;
+
+  if (stats.read != stats.started + stats.dropped
+      || stats.started != stats.finished || n_active != 0)
+    {
+      fprintf (stderr, ("%s: invariant violated: %ld read, %ld started,"
+                        " %ld finished, %ld dropped, %d active\n"),
+               prog, stats.read, stats.started, stats.finished,
+               stats.dropped, n_active);
+      ok = 0;
+    }
+#if defined(__linux__)
+  {
+    char path[64];
+    FILE *f;
+    int pid, i;
+    sprintf (path, "/proc/self/task/%d/children", (int) getpid ());
+    f = fopen (path, "r");
+    while (f && fscanf (f, "%d", &pid) == 1)
+      {
+        for (i = 0; i < n_slots; i++)
+          if (slots[i].sandbox_pid == pid || slots[i].zygote_pid == pid)
+            break;
+        if (i == n_slots)
+          {
+            fprintf (stderr, "%s: invariant violated: child %d leaked\n",
+                     prog, pid);
+            ok = 0;
+          }
+      }
+    if (f)
+      fclose (f);
+  }
+#endif
+  if (!ok)
+    exit (3);
+#endif
 }
 
 int main (int argc, char *argv[])
 {
   char *str;
+  Job *job;
   char **args;
   int first_arg;
   int line_arg;
-  int n_active = 0;
-  int n_faulted = 0;
+  int input_eof = 0;
   int cpid;
   int i;
   int slot;
-  int error_encountered = 0;
 
   /* Defaults from environment */
   str = getenv("FORKARGS_J");
   if (str)
-    slots_string = str;
+    {
+      slots_string = str;
+      slots_from_env = 1;
+    }
 
   in_arguments = stdin;
 
   parse_args(argc, argv, &first_arg);
+  if (hostfile)
+    read_hostfile (hostfile);
+
+  if (token_server_path)
+    {
+      setup_slots (slots_string, NULL, 0);
+      signal (SIGINT, interrupt);
+      signal (SIGTERM, interrupt);
+      token_server (token_server_path);
+    }
+  if (token_socket_path)
+    token_connect ();
 
   /* Collect command arguments */
   args = calloc (argc - first_arg + 2, sizeof (char *));
@@ -589,8 +5447,22 @@ int main (int argc, char *argv[])
   line_arg = i;
 
   setup_slots (slots_string, args, line_arg);
-  if (!skip_slot_test)
-    test_slots (argc, argv);
+  slot_cmd = args;
+  n_slot_cmd = line_arg;
+  check_hosts ();
+
+  if (deadline)
+    {
+      struct stat st;
+      off_t pos = lseek (fileno (in_arguments), 0, SEEK_CUR);
+      if (fstat (fileno (in_arguments), &st) == 0 && S_ISREG (st.st_mode)
+          && pos != -1)
+        input_size = st.st_size - pos;
+      else if (verbose || trace)
+        fprintf (trace ? trace : stderr, ("forkargs: input size unknown;"
+                                          " no deadline estimate until the"
+                                          " end of the input\n"));
+    }
 
   /* Count the number of faulted slots. */
   for (i = 0; i < n_slots; i++)
@@ -602,210 +5474,323 @@ int main (int argc, char *argv[])
       fprintf (stderr, "Bad process limit (%d)\n", n_slots);
       exit (2);
     }
+  if (n_faulted == n_slots)
+    {
+      fprintf (stderr, "%s: no usable slots\n", argv[0]);
+      exit (1);
+    }
+
+  if (scratch_base)
+    scratch_setup ();
+  if (sandbox)
+    sandbox_setup ();
+  if (scratch_base)
+    scratch_start ();
 
   if (trace)
     print_slots(trace);
 
+  if (jobserver_server)
+    jobserver_server_setup (n_slots - n_faulted);
+  else
+    jobserver_client_setup ();
+
+  if (pipe (sigchld_pipe) == -1)
+    {
+      perror (argv[0]);
+      exit (1);
+    }
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl (sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+    }
   signal (SIGINT, interrupt);
+  if (self_profile)
+    profile_setup ();
+  if (fast_path_possible ())
+    {
+      run_fast (argv[0]);
+      if (self_profile)
+        profile_report (stderr);
+      check_invariants (argv[0]);
+      return error_encountered? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+  signal (SIGCHLD, child_exited);
+  if (use_zygote)
+    {
+      for (i = 0; i < n_slots; i++)
+        if (!slots[i].remote_slot && !slots[i].faulted)
+          zygote_start (i, argv[0]);
+      atexit (zygote_kill);
+    }
+  if (use_spawner)
+    spawner_start (argv[0]);
+  if (prewarm)
+    {
+      signal (SIGPIPE, SIG_IGN);
+      for (i = 0; i < n_slots; i++)
+        slots[i].warm_wanted = slot_connects (i);
+    }
+  ramp_start = now ();
+  reprobe_at = ramp_start + reprobe_interval;
+  for (i = 0; i < n_hosts; i++)
+    hosts[i].idle_since = ramp_start;
 
   if (trace)
     fprintf (trace, "forkargs: processing lines\n");
-  while (!interrupted
-         && (!error_encountered
-             || continue_on_error)
-         && (str = read_line (in_arguments))
-         && !interrupted)
-    {
-      /* Strip newline */
-      char *nl = strstr (str, "\n");
-      if (nl)
-        *nl = '\0';
+  job = NULL;
+  for (;;)
+    {
+      double t, t0, delay, wake = -1, poll_wake, d;
+      int ramping, pass, k, warm;
 
-      /* Wait for a free slot */
-      if (n_active + n_faulted >= n_slots)
+      t0 = prof_begin ();
+      reap_children (argv[0]);
+      prof_end (PROF_REAP, t0);
+      t = now ();
+      poll_wake = probe_poll (t);
+      d = idle_poll (t);
+      if (d >= 0 && (poll_wake < 0 || d < poll_wake))
+        poll_wake = d;
+      d = deadline_poll (t, input_eof);
+      if (d >= 0 && (poll_wake < 0 || d < poll_wake))
+        poll_wake = d;
+      if (prewarm && !input_eof && accepting_input ())
         {
-          int status;
-          if (trace)
-            fprintf (trace, ("%s: %d processes active (+%d faulted), "
-                             "waiting for one to finish\n"),
-                     argv[0], n_active, n_faulted);
-          /* Wait for one to exit before proceeding */
-          cpid = wait (&status);
-          if (cpid == -1)
-            {
-              perror(argv[0]);
-              exit(1);
-            }
+          d = prewarm_poll (t);
+          if (d >= 0 && (poll_wake < 0 || d < poll_wake))
+            poll_wake = d;
+        }
+      if (n_faulted == n_slots)
+        {
+          fprintf (stderr, "%s: no usable slots\n", argv[0]);
+          exit (1);
+        }
+      if (commit_file)
+        {
+          t0 = prof_begin ();
+          commit_update (job);
+          prof_end (PROF_RECORDS, t0);
+        }
 
-          if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+      /* Under fair share, the job waiting for a slot is chosen afresh
+         each time round, as running counts change. */
+      if (fair_share && job)
+        {
+          hold_jobs (job);
+          job = NULL;
+        }
+      if (!job)
+        {
+          job = take_job (&input_eof);
+          if (job && resources_available (job) < 0)
             {
-              if (verbose)
-                fprintf (stderr, "forkargs: (%s) exited with return code %d\n",
-                         (slots[slot].hostname ?
-                          slots[slot].hostname : "localhost"),
-                         WEXITSTATUS(status));
+              fprintf (stderr, ("%s: '%s' demands more resources than"
+                                " exist, skipping\n"), argv[0], job->arg);
               error_encountered = 1;
+              drop_job (job);
+              job = NULL;
+              continue;
             }
-
-          if (trace)
-            fprintf (trace, "%s: child %d terminated with status %d (rc %d)\n",
-                     argv[0], cpid, status, WEXITSTATUS(status));
-
-          /* Scan slot table and remove entry */
-          for (i = 0; i < n_slots; i++)
-            if (cpid == slots[i].cpid)
-              {
-                slots[i].cpid = -1;
-                if (slots[i].arg)
-                  free (slots[i].arg);
-                break;
-              }
-          if (i == n_slots)
+        }
+      if (!accepting_input ())
+        {
+          /* Including any read ahead for fair share or resources. */
+          if (job)
+            drop_job (job);
+          job = NULL;
+          while (held_jobs)
             {
-              fprintf (stderr, "%s: cannot find child %d in slot table\n",
-                       argv[0], cpid);
-              exit(1);
+              Job *next = held_jobs->next;
+              drop_job (held_jobs);
+              held_jobs = next;
             }
-
-          n_active--;
         }
-
-      /* Scan the slot table to find a free slot. */
-      for (i = 0; i < n_slots; i++)
-        if (slots[i].cpid == -1 && !slots[i].faulted)
-          break;
-      if (i == n_slots)
+      if (!job)
         {
-          fprintf (stderr, "%s: cannot find a free slot. Miscounted?\n",
-                   argv[0]);
-          exit(1);
+          if (prewarm && (input_eof || !accepting_input ()))
+            prewarm_stop ();
+          if (n_active == 0)
+            break;
+          if (trace)
+            fprintf (trace, "%s: waiting for %d children\n",
+                     argv[0], n_active);
+          wait_for_event (poll_wake);
+          continue;
         }
-      slot = i;
 
-      cpid = fork();
-      if (cpid)
+      /* Scan the slot table for a free slot that is allowed to start
+         a job now, preferring the first slots. While ramping up, slots
+         on warm hosts are preferred. In efficiency mode, slots on
+         busy hosts come first. */
+      t = now ();
+      t0 = prof_begin ();
+      slot = -1;
+      ramping = ramp_mode != RAMP_NONE;
+      if (pack)
         {
-          /* parent */
-          slots[i].cpid = cpid;
-          slots[i].arg = str;
-
-          if (trace)
+          slot_order = realloc (slot_order, n_slots * sizeof (*slot_order));
+          for (k = 0; k < n_slots; k++)
+            slot_order[k] = k;
+          qsort (slot_order, n_slots, sizeof (*slot_order), pack_compare);
+        }
+      if (t < spawn_retry_at)
+        wake = spawn_retry_at - t;
+      else if (n_active < ramp_slots (n_slots - n_faulted, t, &wake)
+               && (!spawn_limit || n_active < spawn_limit)
+               && n_active < pack_limit ()
+               && resources_available (job))
+        for (pass = ramping ? 0 : 1; pass < 2 && slot == -1; pass++)
+          for (k = 0; k < n_slots; k++)
             {
-              fprintf (trace, "Inserted in slot %d.\n", slot);
-              print_slots(trace);
+              i = pack ? slot_order[k] : k;
+              if (slots[i].cpid == -1 && !slots[i].faulted
+                  && !hosts[slots[i].host].checking
+                  && slots[i].host_rank < hosts[slots[i].host].slot_limit
+                  && (slots[i].zygote_fd == -1 || slots[i].zygote_ready)
+                  && (pass || hosts[slots[i].host].warm))
+                {
+                  delay = start_delay (i, t);
+                  if (delay <= 0 && !token_acquire (i, t))
+                    delay = hosts[slots[i].host].token_retry - t;
+                  if (delay <= 0)
+                    {
+                      slot = i;
+                      break;
+                    }
+                  if (wake < 0 || delay < wake)
+                    wake = delay;
+                }
             }
-          
-          n_active++;
-          if (trace)
-            fprintf (trace, "%s: started child %d\n", argv[0], cpid);
+      if (slot != -1 && !jobserver_acquire ())
+        {
+          token_release (slot);
+          slot = -1;
         }
-      else
+      prof_end (PROF_SCHEDULE, t0);
+      if (slot == -1)
         {
-          /* Child. Execute the process. */
-          int status;
-          /* Construct exec parameters */
-          if (slots[slot].remote_slot)
-            slots[slot].args[slots[slot].n_args] = escape_str (str);
-          else
-            slots[slot].args[slots[slot].n_args] = str;
-          slots[slot].args[slots[slot].n_args+1] = NULL;
-
           if (trace)
-            {
-              fprintf (trace, "%s: exec ", argv[0]);
-              for (i = 0; i <= slots[slot].n_args; i++)
-                fprintf (trace, "'%s' ", slots[slot].args[i]);
-              fprintf (trace, "\n");
-            }
-
-          if (verbose)
-            {
-              fprintf (stderr, "forkargs: (%s) ",
-                       (slots[slot].hostname ? slots[slot].hostname
-                        : "localhost"));
-              for (i = 0; i <= slots[slot].n_args; i++)
-                if (strstr(slots[slot].args[i], " ") == NULL)
-                  /* No real need to print anything fancy */
-                  fprintf (stderr, "%s ", slots[slot].args[i]);
-                else if (strstr(slots[slot].args[i], "'") == NULL)
-                  /* Print with '' if that'll look okay */
-                  fprintf (stderr, "'%s' ", slots[slot].args[i]);
-                else
-                  {
-                    /* Escape the whole thing. Looks ugly, but should
-                       be rare. */
-                    char *e = escape_str (slots[slot].args[i]);
-                    fprintf (stderr, "%s ", e);
-                    free (e);
-                  }
-              fprintf (stderr, "\n");
-            }
+            fprintf (trace, ("%s: %d processes active (+%d faulted), "
+                             "waiting to start another\n"),
+                     argv[0], n_active, n_faulted);
+          if (poll_wake >= 0 && (wake < 0 || poll_wake < wake))
+            wake = poll_wake;
+          wait_for_event (wake);
+          continue;
+        }
 
-          /* Close parent's stdin */
-          close(STDIN_FILENO);
-          open("/dev/null", O_RDONLY);
+      warm = slots[slot].warm_fd != -1;
+      if (!warm)
+        {
+          bucket_take (&start_bucket);
+          bucket_take (&hosts[slots[slot].host].start_bucket);
+        }
+      claim_resources (job, 1);
+      if (batch_size > 1 && slots[slot].remote_slot)
+        batch_gather (job, &input_eof);
 
-          /* Change working directory, but only if it's a local slot! */
-          if (slots[slot].working_dir != NULL && slots[slot].hostname == NULL)
-            {
-              if (trace)
-                fprintf (trace, "forkargs: chdir to '%s'\n",
-                         slots[slot].working_dir);
-              if (chdir(slots[slot].working_dir) == -1)
-                {
-                  perror(slots[slot].args[0]);
-                  exit(1);
-                }
-            }
-          status = execvp(slots[slot].args[0], slots[slot].args);
-          if (status == -1)
+      t0 = prof_begin ();
+      slots[slot].spawn_at = t0;
+      slots[slot].connect_at = t;
+      cpid = spawn_job (slot, job, argv[0]);
+      prof_end (PROF_FORK, t0);
+      if (cpid == -1)
+        {
+          /* Keep the job for another go, unless it can never work. */
+          batch_undo (job);
+          claim_resources (job, -1);
+          token_release (slot);
+          if (!warm)
             {
-              perror(slots[slot].args[0]);
-              exit(1);
+              bucket_refund (&start_bucket);
+              bucket_refund (&hosts[slots[slot].host].start_bucket);
             }
+          if (slots[slot].faulted)
+            ;                   /* eg. a lost zygote: try another slot */
+          else if (spawn_error_transient (errno))
+            spawn_failed (t, argv[0]);
           else
             {
-              exit(0);
+              perror (argv[0]);
+              error_encountered = 1;
+              drop_job (job);
+              job = NULL;
             }
+          continue;
+        }
+      spawn_backoff = 0;
+      slots[slot].cpid = cpid;
+      hosts[slots[slot].host].running++;
+      hosts[slots[slot].host].idle_hooked = 0;
+      slots[slot].job = job;
+      slots[slot].started = t;
+      for (k = 0; job; job = job->next, k++)
+        {
+          /* Each lane of a batch runs its jobs one after another, so
+             only the first in each has started yet. */
+          job->lane = k % batch_lanes;
+          job->started = t;
+          stats.started++;
+          if (fair_share)
+            submitters[job->submitter].running++;
         }
+
+      if (trace)
+        {
+          fprintf (trace, "Inserted in slot %d.\n", slot);
+          print_slots(trace);
+        }
+
+      n_active++;
+      if (prewarm && slot_connects (slot) && !slots[slot].warm_pid)
+        slots[slot].warm_wanted = 1;
+      if (FAULT ("kill-child"))
+        kill (cpid, SIGKILL);
+      if (trace)
+        fprintf (trace, "%s: started child %d\n", argv[0], cpid);
     }
   if (trace)
     fprintf (trace, "forkargs: finished processing lines\n");
 
-
-  /* Wait for all children to terminate */
-  while (n_active)
+  if (spawner_fd != -1)
     {
       int status;
-      if (trace)
-        fprintf (trace, "%s: waiting for %d children\n", argv[0], n_active);
-      cpid = wait(&status);
-      if (trace)
-        fprintf (trace, "%s: child %d terminated\n", argv[0], cpid);
-      n_active --;
-      if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
-        {
-          if (verbose)
-            fprintf (stderr, "forkargs: (%s) exited with return code %d\n",
-                     slots[slot].hostname ? slots[slot].hostname : "localhost",
-                     WEXITSTATUS(status));
-          error_encountered = 1;
-        }
-
-      /* Clear out the slot table */
-      for (i = 0; i < n_slots; i++)
-        if (slots[i].cpid == cpid)
-          {
-            slots[i].cpid = -1;
-            free (slots[i].arg);
-            if (trace)
-              {
-                fprintf (trace, "Removed process from slot table entry %d\n", i);
-                print_slots(trace);
-                break;
-              }
-          }
+      close (spawner_fd);
+      spawner_fd = -1;
+      waitpid (spawner_pid, &status, 0);
     }
+  check_cancel ();
+  if (deadline_fd != -1)
+    close (deadline_fd);
+  if (deadline && (verbose || trace))
+    fprintf (trace ? trace : stderr, "forkargs: finished %.0fs %s the deadline\n",
+             deadline > now () ? deadline - now () : now () - deadline,
+             deadline > now () ? "before" : "after");
+  for (i = 0; i < n_hooks; i++)
+    {
+      int status;
+      waitpid (hooks[i], &status, 0);
+    }
+  n_hooks = 0;
+  if (fair_share && (verbose || trace))
+    fair_report (trace ? trace : stderr);
+  for (i = 0; i < n_slots; i++)
+    if (slots[i].warm_pid)
+      {
+        int status;
+        waitpid (slots[i].warm_pid, &status, 0);
+        slots[i].warm_pid = 0;
+      }
+  if (scratch_base)
+    scratch_finish ();
+  if (commit_file)
+    commit_update (NULL);
+  if (self_profile)
+    profile_report (stderr);
+  check_invariants (argv[0]);
 
   return error_encountered? EXIT_FAILURE : EXIT_SUCCESS;
 }